@@ -3,63 +3,256 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
 #include "allocomora.h"
 #include "custom_unistd.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 // Control number: 110
 
 // Static variables
-static struct heap_t heap;
-static pthread_mutex_t heap_mtx;
-static pthread_mutexattr_t heap_mtxa;
+static struct arena_t arenas[ARENA_MAX];
+static int arena_count;
+static char *region_start; // start of the space taken from custom_sbrk(), the page map is relative to it
+static struct page_map_t page_map;
+static struct heap_config_t heap_config;
+static unsigned int heap_generation;
+static unsigned int next_arena;
+static __thread int thread_arena = -1;
+static __thread struct thread_cache_t thread_cache;
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+static struct debug_site_t debug_sites_initial[DEBUG_SITES_INITIAL];
+static struct debug_site_t *debug_sites = debug_sites_initial; // bigger tables are allocated with the C library's calloc
+static size_t debug_sites_capacity = DEBUG_SITES_INITIAL;
+static size_t debug_sites_count;
+static pthread_mutex_t debug_sites_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct chunk_t *large_head; // blocks in the mmap region, linked through next and prev
+static int large_count;
+static size_t large_pages;
+static pthread_mutex_t large_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct heap_region_t *regions; // live regions
+static pthread_mutex_t regions_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct heap_pool_t *pools; // live pools
+static pthread_mutex_t pools_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t crc32c_table[256];
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+static struct heap_realloc_stats_t realloc_stats;
+static FILE *trace_file;
+static int trace_active;
+static uint64_t trace_start_time;
+static unsigned int trace_generation;
+static uint32_t trace_next_thread;
+static struct trace_buffer_t *trace_buffers;
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_buffer_t *trace_buffer; // allocated with the C library's malloc when a thread first records
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static struct instrument_counters_t *instrument_threads;
+static struct heap_instrument_t instrument_retired; // counters of exited threads
+static unsigned int instrument_generation;
+static pthread_mutex_t instrument_mtx = PTHREAD_MUTEX_INITIALIZER;
+#if ALLOCOMORA_INSTRUMENT
+static __thread struct instrument_counters_t *instrument_thread; // allocated with the C library's malloc
+static struct instrument_counters_t instrument_discard; // used if that fails
+static pthread_key_t instrument_key;
+static pthread_once_t instrument_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Static functions
+static void arena_init(struct arena_t *arena, char *data, int pages);
+static struct arena_t *arena_of(const void *pointer);
+static struct arena_t *arena_lock(void);
+static void arena_unlock(struct arena_t *arena);
+static struct chunk_t *arena_alloc(struct arena_t *arena, size_t count, int fileline, const char *filename);
+static struct chunk_t *arena_alloc_aligned(struct arena_t *arena, size_t count, size_t alignment, int fileline, const char *filename);
+static int arena_grow(struct arena_t *arena, size_t count);
+static int arena_alloc_batch(struct arena_t *arena, size_t count, size_t size, size_t needed, void **out);
+static void absorb_next(struct chunk_t *chunk);
+static struct chunk_t *merge_backward(struct chunk_t *chunk);
+static void realloc_count(uint64_t *counter);
+static int size_bucket(size_t size);
+static void used_size_update(struct arena_t *arena, size_t size, int64_t delta);
+static void wasted_tail_count(struct arena_t *arena, size_t bytes);
+static void arena_update_end_fence(struct arena_t *arena);
+static void update_arena_checksum(struct arena_t *arena);
+static int verify_arena_checksum(struct arena_t *arena);
+static enum validation_code_t arena_validate(struct arena_t *arena);
+static void freelist_mapping(size_t size, int *fli, int *sli);
+static struct chunk_t *freelist_search(struct free_index_t *free_index, int *fli, int *sli);
+static struct free_links_t *freelist_links(struct chunk_t *chunk);
+static size_t pagemap_page(const void *pointer);
+static size_t pagemap_prev_page(size_t page);
+static void stats_publish(struct arena_t *arena);
+static void free_chunk(struct chunk_t *chunk);
+static void release_chunk(struct chunk_t *chunk);
+static int quick_put(struct chunk_t *chunk);
+static struct chunk_t *quick_get(struct arena_t *arena, size_t count);
+static int quick_coalesce(struct arena_t *arena, int bin);
+static void heap_trim(struct arena_t *arena);
+static struct slab_t *slab_of(struct chunk_t *chunk);
+static void slab_init(struct chunk_t *chunk, int size_class);
+static void *slab_alloc(struct arena_t *arena, size_t count);
+static void slab_free(struct chunk_t *chunk, void *pointer);
+static size_t slab_object_size(const void *pointer);
+static enum pointer_type_t slab_pointer_type(struct slab_t *slab, const char *p);
+static int is_large(size_t count);
+static size_t large_map_size(size_t count);
+static int large_candidate(const void *pointer);
+static struct chunk_t *large_find(const void *pointer);
+static void large_map_set(struct chunk_t *chunk, size_t map_size, struct chunk_t *block);
+static void *large_alloc(size_t count, int fileline, const char *filename);
+static void *large_realloc(void *memblock, size_t size);
+static void large_free(void *memblock, size_t size);
+static void large_unmap(struct chunk_t *chunk);
+static enum pointer_type_t large_pointer_type(const char *p);
+static enum validation_code_t large_validate(void);
+static struct chunk_t *chunk_of(const void *pointer);
+static struct thread_cache_t *tcache_current(void);
+static struct chunk_t *tcache_get(size_t count);
+static int tcache_put(void *memblock);
+static void tcache_flush(struct thread_cache_t *cache, int bin, int count);
+static struct chunk_t **tcache_link(struct chunk_t *chunk);
+static void *malloc_internal(size_t count, int fileline, const char *filename);
+static void *realloc_internal(void *memblock, size_t size, int fileline, const char *filename);
+static void free_internal(void *memblock);
+static void free_sized_internal(void *memblock, size_t size);
+static size_t malloc_batch_internal(size_t count, size_t size, void **out);
+static void free_batch_internal(void **ptrs, size_t n);
+static uint64_t now_ns(void);
+static void trace_record(enum trace_op_t op, uint64_t time, size_t size, const void *id, const void *old_id);
+static void trace_flush(struct trace_buffer_t *buffer);
+#if ALLOCOMORA_INSTRUMENT
+static struct instrument_counters_t *instrument_current(void);
+static void instrument_count(uint64_t *counter, uint64_t n);
+static void instrument_time(enum timed_op_t op, uint64_t start);
+#endif
+static void instrument_add(struct heap_instrument_t *sum, const struct heap_instrument_t *counters);
+static struct chunk_t *unlocked_chunk(void *memblock);
+static int chunk_claim(struct chunk_t *chunk);
+static int remote_free_push(struct arena_t *arena, void *memblock);
+static void remote_free_drain(struct arena_t *arena);
+static void region_block_init(struct heap_region_t *region, struct region_block_t *block, size_t size);
+static int region_grow(struct heap_region_t *region, size_t size);
+static enum validation_code_t region_validate(void);
+static int pool_grow(struct heap_pool_t *pool);
+static void pool_stats_add(const struct heap_pool_t *pool, struct heap_pool_stats_t *stats);
+static enum validation_code_t pool_validate(void);
+static size_t debug_site_slot(const struct chunk_t *chunk);
+static int debug_sites_grow(void);
+static void debug_site_set(struct chunk_t *chunk, int fileline, const char *filename);
+static void debug_site_remove(struct chunk_t *chunk);
+static struct debug_site_t *debug_site_find(const struct chunk_t *chunk);
+static void checksum_init(void);
+static uint32_t crc32c_sw(const void *data, size_t size);
+#if defined(__x86_64__)
+static uint32_t crc32c_hw(const void *data, size_t size);
+#endif
+static uint32_t (*checksum_kernel)(const void *data, size_t size) = crc32c_sw;
 
 // Heap basic functions
 int heap_setup() {
-    if(heap.is_set) {
+    return heap_setup_config(NULL);
+}
+
+int heap_setup_config(const struct heap_config_t *config) {
+    if(arenas[0].heap.is_set) {
         printf("-Log- Heap is already set up.\n");
         return 0;
     }
-    
-    heap.data=custom_sbrk(PAGES_BGN*PAGE_SIZE);
-    if (heap.data == (void*)-1) {
+    pthread_once(&checksum_once,checksum_init);
+
+    struct heap_config_t new_config;
+    if(config!=NULL) new_config=*config;
+    else {
+        memset(&new_config,0,sizeof(new_config));
+        new_config.thread_cache_count=TCACHE_COUNT_DEFAULT;
+        new_config.quick_list_count=QUICK_COUNT_DEFAULT;
+    }
+    if(new_config.arena_count==0) new_config.arena_count=ARENA_COUNT_DEFAULT;
+    if(new_config.arena_pages==0) new_config.arena_pages=ARENA_PAGES_DEFAULT;
+    if(new_config.trim_threshold==0) new_config.trim_threshold=TRIM_THRESHOLD_DEFAULT;
+    // Arena regions have to start at a page map word, so that arenas never share one.
+    if(new_config.arena_count<1 || new_config.arena_count>ARENA_MAX || new_config.arena_pages<0 || new_config.arena_pages%64
+        || (new_config.arena_count-1)*new_config.arena_pages+PAGES_BGN>PAGEMAP_PAGES) {
+        if(LOG) printf("-Log- Invalid arena configuration.\n");
+        return -1;
+    }
+    if(new_config.large_threshold<0 || (new_config.large_threshold>0 && new_config.large_threshold<LARGE_THRESHOLD_MIN)) {
+        if(LOG) printf("-Log- Invalid large block threshold.\n");
+        return -1;
+    }
+
+    size_t arenas_size=(size_t)(new_config.arena_count-1)*new_config.arena_pages*PAGE_SIZE;
+    INSTRUMENT_COUNT(sbrk_calls,1);
+    char *data=custom_sbrk(arenas_size+PAGES_BGN*PAGE_SIZE);
+    if (data == (void*)-1) {
         if(LOG) printf("-Log- sbrk() error.\n");
         return -1;
     }
+    heap_config=new_config;
+    arena_count=new_config.arena_count;
+    region_start=data;
+
+    memset(&page_map,0,sizeof(page_map));
+
+    // The main heap goes last, so it can keep growing with custom_sbrk().
+    arena_init(&arenas[0],data+arenas_size,PAGES_BGN);
+    for(int i=1; i<arena_count; i++) arena_init(&arenas[i],data+(size_t)(i-1)*heap_config.arena_pages*PAGE_SIZE,heap_config.arena_pages);
+    heap_generation++;
+    memset(&realloc_stats,0,sizeof(realloc_stats));
+    if(LOG) printf("-Log- Heap successfully initialized.\n");
+
+    return 0;
+}
 
+static void arena_init(struct arena_t *arena, char *data, int pages) {
+    struct heap_t *heap = &arena->heap;
     struct chunk_t mainchunk;
     memset(&mainchunk,0,sizeof(mainchunk));
     mainchunk.prev=NULL;
     mainchunk.next=NULL;
-    mainchunk.size=(PAGES_BGN*PAGE_SIZE)-(sizeof(struct chunk_t)+sizeof(int));
+    mainchunk.size=((size_t)pages*PAGE_SIZE)-(sizeof(struct chunk_t)+sizeof(int));
     mainchunk.alloc=0;
-    mainchunk.first_fence=FIRFENCE;
-    mainchunk.second_fence=SECFENCE;
-    mainchunk.debug_file=NULL;
-    mainchunk.debug_line=0;
-
-    memcpy(heap.data,&mainchunk,sizeof(struct chunk_t));
-    heap.head_chunk=(struct chunk_t *)heap.data;
-    heap.tail_chunk=(struct chunk_t *)heap.data;
-    
-    pthread_mutexattr_init(&heap_mtxa);
-    pthread_mutexattr_settype(&heap_mtxa,PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&heap_mtx,&heap_mtxa);
+    FENCES_SET(&mainchunk);
+    mainchunk.debug=0;
 
-    heap.is_set=1;
-    heap.pages=PAGES_BGN;
-    heap.chunks=1;
+    memcpy(data,&mainchunk,sizeof(struct chunk_t));
+    heap->data=data;
+    heap->head_chunk=(struct chunk_t *)data;
+    heap->tail_chunk=(struct chunk_t *)data;
+    memset(&arena->free_index,0,sizeof(arena->free_index));
+    memset(arena->slabs,0,sizeof(arena->slabs));
+    arena->slab_count=0;
+    arena->slab_objects=0;
+    arena->slab_free_bytes=0;
+    arena->remote_frees=NULL;
+    memset(arena->used_sizes,0,sizeof(arena->used_sizes));
+    arena->wasted_tails=0;
+    arena->wasted_tail_bytes=0;
+    memset(arena->quick,0,sizeof(arena->quick));
+    memset(arena->quick_counts,0,sizeof(arena->quick_counts));
+    arena->quick_chunks=0;
+    arena->quick_bytes=0;
+    freelist_insert(heap->head_chunk);
+    pagemap_add(heap->head_chunk);
+    pthread_mutex_init(&arena->mtx,NULL); // never locked twice by a thread
 
-    update_end_fence();
-    update_chunk_checksum(heap.head_chunk);
-    update_heap_checksum();
-    if(LOG) printf("-Log- Heap successfully initialized.\n");
+    heap->is_set=1;
+    heap->pages=pages;
+    heap->chunks=1;
 
-    return 0;
+    arena_update_end_fence(arena);
+    CHUNK_CHECKSUM_UPDATE(heap->head_chunk);
+    ARENA_CHECKSUM_UPDATE(arena);
+    stats_publish(arena);
 }
 
 int heap_delete(int force_mode) {
-    // If "force mode" is 1, all allocated blocks will be freed automatically.
-    if(!heap.is_set) {
+    // If "force mode" is 1, the heap is deleted even if some blocks are still allocated.
+    if(!arenas[0].heap.is_set) {
         if(LOG) printf("-Log- Heap isn't initialized.\n");
         return 1;
     }
@@ -67,259 +260,629 @@ int heap_delete(int force_mode) {
         if(LOG) printf("-Log- Heap is corrupted.\n");
         return 2;
     }
-    
-    pthread_mutex_destroy(&heap_mtx);
-    pthread_mutexattr_destroy(&heap_mtxa);
+    heap_thread_cache_flush(); // caches of other threads are dropped when they see a new heap
+    for(int i=0; i<arena_count; i++) {
+        pthread_mutex_lock(&arenas[i].mtx);
+        quick_coalesce(&arenas[i],-1);
+        arena_unlock(&arenas[i]); // drains frees pushed by other threads
+    }
 
-    struct chunk_t *p = heap.head_chunk;
-    while(p) {
-        if(p->alloc) {
-            if(force_mode==1) heap_free(p);
-            else {
-                if(LOG) printf("-Log- Some blocks are still allocated. Use \"force mode\" to free them automatically or heap_free() to free them manually.\n");
-                return 3;
-            }
+    for(int i=0; i<arena_count && force_mode!=1; i++) {
+        struct arena_t *arena = &arenas[i];
+        if((uint64_t)arena->heap.chunks-arena->free_index.free_chunks-arena->slab_count+arena->slab_objects) {
+            if(LOG) printf("-Log- Some blocks are still allocated. Use \"force mode\" to free them automatically or heap_free() to free them manually.\n");
+            return 3;
         }
-        p=p->next;
     }
-    void *check=custom_sbrk(-(heap_get_used_space()+heap_get_free_space()));
+    if(force_mode!=1 && __atomic_load_n(&large_count,__ATOMIC_RELAXED)) {
+        if(LOG) printf("-Log- Some large blocks are still allocated. Use \"force mode\" to free them automatically or heap_free() to free them manually.\n");
+        return 3;
+    }
+    pthread_mutex_lock(&large_mtx);
+    while(large_head) large_unmap(large_head);
+    pthread_mutex_unlock(&large_mtx);
+    pthread_mutex_lock(&regions_mtx);
+    regions=NULL; // their blocks go away with the heap
+    pthread_mutex_unlock(&regions_mtx);
+    pthread_mutex_lock(&pools_mtx);
+    pools=NULL;
+    pthread_mutex_unlock(&pools_mtx);
+    size_t heap_size=(size_t)(arena_count-1)*heap_config.arena_pages*PAGE_SIZE+(size_t)arenas[0].heap.pages*PAGE_SIZE;
+    INSTRUMENT_COUNT(sbrk_calls,1);
+    void *check=custom_sbrk(-(intptr_t)heap_size);
     if(check==(void*)-1) {
         if(LOG) printf("-Log- sbrk() error.\n");
         return -1;
     }
-    heap.is_set=0;
+    for(int i=0; i<arena_count; i++) {
+        struct arena_t *arena = &arenas[i];
+        pthread_mutex_destroy(&arena->mtx);
+        arena->heap.is_set=0;
+        arena->heap.pages=0;
+        arena->heap.chunks=0;
+        memset(&arena->free_index,0,sizeof(arena->free_index));
+        memset(arena->slabs,0,sizeof(arena->slabs));
+        arena->slab_count=0;
+        arena->slab_objects=0;
+        arena->slab_free_bytes=0;
+        stats_publish(arena);
+    }
+    pthread_mutex_lock(&debug_sites_mtx);
+    if(debug_sites!=debug_sites_initial) free(debug_sites);
+    memset(debug_sites_initial,0,sizeof(debug_sites_initial));
+    debug_sites=debug_sites_initial;
+    debug_sites_capacity=DEBUG_SITES_INITIAL;
+    debug_sites_count=0;
+    pthread_mutex_unlock(&debug_sites_mtx);
     if(LOG) printf("-Log- Heap successfully deleted.\n");
     return 0;
 }
 
 int heap_reset(int force_mode) {
     if(LOG) printf("-Log- Resetting a heap.\n");
+    struct heap_config_t config = heap_config;
     int res = heap_delete(force_mode);
     if(res) return res;
-    return heap_setup();
+    return heap_setup_config(&config);
+}
+
+// Arena functions
+static struct arena_t *arena_of(const void *pointer) {
+    // Arenas other than the main one lie before it, arena_pages each.
+    char *p = (char*)pointer;
+    if(arena_count>1 && p>=region_start && p<(char*)arenas[0].heap.data) {
+        return &arenas[1+(p-region_start)/((size_t)heap_config.arena_pages*PAGE_SIZE)];
+    }
+    return &arenas[0];
+}
+
+static struct arena_t *arena_lock(void) {
+    // Locks the arena of the calling thread. Threads are spread round-robin, and a thread whose arena
+    // is busy moves to the first one it can lock without waiting.
+    if(arena_count==1) {
+        pthread_mutex_lock(&arenas[0].mtx);
+        remote_free_drain(&arenas[0]);
+        return &arenas[0];
+    }
+    if(thread_arena<0) thread_arena=__atomic_fetch_add(&next_arena,1,__ATOMIC_RELAXED)%ARENA_MAX;
+    int first=thread_arena%arena_count;
+    for(int i=0; i<arena_count; i++) {
+        int id=(first+i)%arena_count;
+        if(pthread_mutex_trylock(&arenas[id].mtx)==0) {
+            thread_arena=id;
+            remote_free_drain(&arenas[id]);
+            return &arenas[id];
+        }
+    }
+    pthread_mutex_lock(&arenas[first].mtx);
+    remote_free_drain(&arenas[first]);
+    return &arenas[first];
+}
+
+static void arena_unlock(struct arena_t *arena) {
+    // Frees pushed while the lock was held are done before giving it up. A push landing after the last
+    // drain is seen by the check below, or by its own thread, which tries the lock once more after pushing.
+    do {
+        remote_free_drain(arena);
+        stats_publish(arena);
+        pthread_mutex_unlock(&arena->mtx);
+    } while(__atomic_load_n(&arena->remote_frees,__ATOMIC_SEQ_CST)!=NULL && pthread_mutex_trylock(&arena->mtx)==0);
 }
 
 // *alloc functions
 void *heap_malloc_debug(size_t count, int fileline, const char* filename) {
-    pthread_mutex_lock(&heap_mtx);
-    struct chunk_t *chunk_to_alloc = find_free_chunk(count);
-    if(chunk_to_alloc!=NULL) {
-        if(LOG) printf("-Log- Found a free chunk %p (%lu).\n", chunk_to_alloc, chunk_to_alloc->size);
-        if(chunk_to_alloc->size==count) {
-            chunk_to_alloc->alloc=1;
-            chunk_to_alloc->debug_line=fileline;
-            chunk_to_alloc->debug_file=filename;
-            update_heap_data();
-            update_chunk_checksum(chunk_to_alloc);
-            pthread_mutex_unlock(&heap_mtx);
-            return (void*)((char*)chunk_to_alloc+sizeof(struct chunk_t));
-        }
-        else if(chunk_to_alloc->size>count+sizeof(struct chunk_t)) {
-            if(LOG) printf("-Log- Chunk is too large. Splitting.\n");
-            struct chunk_t *res=NULL;
-            res=split(chunk_to_alloc,count);
-            if (res==NULL) {
-                if(LOG) printf("-Log- Can't split a chunk.\n");
-                pthread_mutex_unlock(&heap_mtx);
-                return NULL;
+    INSTRUMENT_START(start);
+    void *p = malloc_internal(count,fileline,filename);
+    INSTRUMENT_END(timed_malloc,start);
+    if(__atomic_load_n(&trace_active,__ATOMIC_RELAXED)) trace_record(trace_malloc,now_ns(),count,p,NULL);
+    return p;
+}
+
+static void *malloc_internal(size_t count, int fileline, const char* filename) {
+    if(is_large(count)) {
+        void *block = large_alloc(count,fileline,filename);
+        if(block!=NULL) return block;
+        if(LOG) printf("-Log- No space in the mmap region. Using the heap.\n");
+    }
+    if(filename==NULL && fileline==0) {
+        // Cached chunks are reused without touching their control block, so only for calls without debug info.
+        struct chunk_t *cached = tcache_get(count);
+        if(cached!=NULL) return (void*)((char*)cached+sizeof(struct chunk_t));
+        if(count>0 && count<=heap_config.slab_max_size) {
+            struct arena_t *arena = arena_lock();
+            void *object = slab_alloc(arena,count);
+            if(object==NULL && arena!=&arenas[0]) {
+                arena_unlock(arena);
+                arena=&arenas[0];
+                pthread_mutex_lock(&arena->mtx);
+                object=slab_alloc(arena,count);
             }
-            res->alloc=1;
-            res->debug_line=fileline;
-            res->debug_file=filename;
-            update_chunk_checksum(res);
-            update_heap_data();
-            pthread_mutex_unlock(&heap_mtx);
-            return (void*)((char*)res+sizeof(struct chunk_t));
+            // There's no space for a new slab, the main heap grows for its chunk.
+            if(object==NULL && arena_grow(arena,SLAB_SIZE+sizeof(struct chunk_t)+1)==0) object=slab_alloc(arena,count);
+            arena_unlock(arena);
+            return object;
+        }
+    }
+    struct arena_t *arena = arena_lock();
+    struct chunk_t *chunk = arena_alloc(arena,count,fileline,filename);
+    if(chunk==NULL && arena!=&arenas[0]) {
+        if(LOG) printf("-Log- Arena %d is full. Using the main heap.\n",(int)(arena-arenas));
+        arena_unlock(arena);
+        arena=&arenas[0];
+        pthread_mutex_lock(&arena->mtx);
+        chunk=arena_alloc(arena,count,fileline,filename);
+    }
+    if(chunk==NULL) {
+        // The grown tail chunk is big enough to be split, so the allocation can't fail again.
+        if(LOG) printf("-Log- Free block not found. Asking for more space.\n");
+        if(count<SIZE_MAX-sizeof(struct chunk_t) && arena_grow(arena,count+sizeof(struct chunk_t)+1)==0) chunk=arena_alloc(arena,count,fileline,filename);
+    }
+    arena_unlock(arena);
+    if(chunk==NULL) return NULL;
+    return (void*)((char*)chunk+sizeof(struct chunk_t));
+}
+
+static struct chunk_t *arena_alloc(struct arena_t *arena, size_t count, int fileline, const char *filename) {
+    // Allocates a chunk from the parked or free chunks of a locked arena, NULL if none of them fits.
+    // Parked chunks are merged before giving up.
+    struct chunk_t *chunk_to_alloc = quick_get(arena,count);
+    if(chunk_to_alloc!=NULL) {
+        debug_site_set(chunk_to_alloc,fileline,filename);
+        CHUNK_CHECKSUM_UPDATE(chunk_to_alloc);
+        return chunk_to_alloc;
+    }
+    chunk_to_alloc=find_free_chunk(arena,count);
+    if(chunk_to_alloc==NULL && quick_coalesce(arena,-1)) chunk_to_alloc=find_free_chunk(arena,count);
+    if(chunk_to_alloc==NULL) return NULL;
+    if(LOG) printf("-Log- Found a free chunk %p (%lu).\n", chunk_to_alloc, chunk_to_alloc->size);
+    freelist_remove(chunk_to_alloc);
+    if(chunk_to_alloc->size==count) {
+        chunk_to_alloc->alloc=1;
+        used_size_update(arena,chunk_to_alloc->size,1);
+        debug_site_set(chunk_to_alloc,fileline,filename);
+        ARENA_CHECKSUM_UPDATE(arena);
+        CHUNK_CHECKSUM_UPDATE(chunk_to_alloc);
+        return chunk_to_alloc;
+    }
+    else if(chunk_to_alloc->size>count+sizeof(struct chunk_t)) {
+        if(LOG) printf("-Log- Chunk is too large. Splitting.\n");
+        struct chunk_t *res=NULL;
+        chunk_to_alloc->alloc=1;
+        used_size_update(arena,chunk_to_alloc->size,1);
+        res=split(chunk_to_alloc,count);
+        if (res==NULL) {
+            if(LOG) printf("-Log- Can't split a chunk.\n");
+            used_size_update(arena,chunk_to_alloc->size,-1);
+            chunk_to_alloc->alloc=0;
+            freelist_insert(chunk_to_alloc);
+            return NULL;
         }
+        debug_site_set(res,fileline,filename);
+        CHUNK_CHECKSUM_UPDATE(res);
+        ARENA_CHECKSUM_UPDATE(arena);
+        return res;
     }
-    if(LOG) printf("-Log- Free block not found. Asking for more space.\n");
+    freelist_insert(chunk_to_alloc);
+    return NULL;
+}
+
+static int arena_grow(struct arena_t *arena, size_t count) {
+    // Adds pages to the end of the locked main heap, so that its tail chunk can hold count bytes.
+    struct heap_t *heap = &arena->heap;
     size_t wanted_size;
-    if (heap.tail_chunk->alloc) wanted_size=count+sizeof(struct chunk_t);
+    if (heap->tail_chunk->alloc) wanted_size=count+sizeof(struct chunk_t);
     else wanted_size=count;
     intptr_t wanted_memory = PAGE_SIZE*((wanted_size/PAGE_SIZE)+(!!(wanted_size%PAGE_SIZE)));
+    if ((arena_count-1)*heap_config.arena_pages+heap->pages+wanted_memory/PAGE_SIZE>PAGEMAP_PAGES) {
+        if(LOG) printf("-Log- Heap can't be bigger than %d pages.\n",PAGEMAP_PAGES);
+        return -1;
+    }
+    INSTRUMENT_COUNT(sbrk_calls,1);
     if (custom_sbrk(wanted_memory)==(void*)-1) {
-        pthread_mutex_unlock(&heap_mtx);
         if(LOG) printf("-Log- sbrk() error.\n");
-        return NULL;
+        return -1;
     }
-    heap.pages+=wanted_memory/PAGE_SIZE;
-    if(LOG) printf("-Log- Pages increased to %d.\n",heap.pages);
+    heap->pages+=wanted_memory/PAGE_SIZE;
+    if(LOG) printf("-Log- Pages increased to %d.\n",heap->pages);
 
-    if(heap.tail_chunk->alloc) {
+    if(heap->tail_chunk->alloc) {
         if(LOG) printf("-Log- Tail chunk is allocated. Creating a new chunk\n");
         struct chunk_t new_chunk;
-        struct chunk_t *new_tail = heap.tail_chunk+heap.tail_chunk->size+sizeof(struct chunk_t);
+        struct chunk_t *new_tail = (struct chunk_t *)((char*)heap->tail_chunk+heap->tail_chunk->size+sizeof(struct chunk_t));
 
-        new_chunk.first_fence=FIRFENCE;
-        new_chunk.second_fence=SECFENCE;
-        new_chunk.size=wanted_memory;
-        new_chunk.prev=heap.tail_chunk;
+        memset(&new_chunk,0,sizeof(new_chunk));
+        FENCES_SET(&new_chunk);
+        new_chunk.size=wanted_memory-sizeof(struct chunk_t); // the new header takes the old end fence's place
+        new_chunk.prev=heap->tail_chunk;
         new_chunk.next=NULL;
-        heap.tail_chunk->next=new_tail;
+        heap->tail_chunk->next=new_tail;
+        CHUNK_CHECKSUM_UPDATE(heap->tail_chunk);
         new_chunk.alloc=0;
         
         memcpy(new_tail,&new_chunk,sizeof(struct chunk_t));
-        heap.tail_chunk=new_tail;
-        heap.chunks++;
-        update_chunk_checksum(new_tail);
+        heap->tail_chunk=new_tail;
+        heap->chunks++;
+        freelist_insert(new_tail);
+        pagemap_add(new_tail);
+        CHUNK_CHECKSUM_UPDATE(new_tail);
     }
     else {
         if(LOG) printf("-Log- Tail chunk is free. Extending it.\n");
-        heap.tail_chunk->size=heap.tail_chunk->size+wanted_memory;
+        freelist_remove(heap->tail_chunk);
+        heap->tail_chunk->size=heap->tail_chunk->size+wanted_memory;
+        freelist_insert(heap->tail_chunk);
     }
 
     if(TESTING) printf("-Testing- #1\n");
-    update_chunk_checksum(heap.tail_chunk);
+    CHUNK_CHECKSUM_UPDATE(heap->tail_chunk);
     if(TESTING) printf("-Testing- #2\n");
-    update_end_fence();
+    arena_update_end_fence(arena);
     if(TESTING) printf("-Testing- #3\n");
     if(LOG) printf("-Log- Heap size successfully increased.\n");
-    pthread_mutex_unlock(&heap_mtx);
-    return heap_malloc_debug(count,fileline,filename); //try allocating again, now with more space.
+    return 0;
+}
+
+size_t heap_malloc_batch(size_t count, size_t size, void **out) {
+    size_t done=malloc_batch_internal(count,size,out);
+    if(__atomic_load_n(&trace_active,__ATOMIC_RELAXED)) {
+        uint64_t time=now_ns();
+        for(size_t i=0; i<done; i++) trace_record(trace_malloc,time,size,out[i],NULL);
+    }
+    return done;
+}
+
+static size_t malloc_batch_internal(size_t count, size_t size, void **out) {
+    // Allocates count blocks of the same size with one lock acquisition. Chunks are carved one after another
+    // from a single free chunk. Returns count, or 0 (with nothing allocated) if there isn't enough memory.
+    if(count==0 || out==NULL) return 0;
+    if(is_large(size) || (size>0 && size<=heap_config.slab_max_size)) {
+        size_t i;
+        if(size>0 && size<=heap_config.slab_max_size) {
+            struct arena_t *arena = arena_lock();
+            for(i=0; i<count && (out[i]=slab_alloc(arena,size))!=NULL; i++);
+            arena_unlock(arena);
+        }
+        else i=0;
+        for(; i<count && (out[i]=malloc_internal(size,0,NULL))!=NULL; i++);
+        if(i==count) return count;
+        free_batch_internal(out,i);
+        return 0;
+    }
+    if(size>(SIZE_MAX-sizeof(struct chunk_t))/count-sizeof(struct chunk_t)) return 0;
+    size_t needed=count*(size+sizeof(struct chunk_t))-sizeof(struct chunk_t);
+
+    struct arena_t *arena = arena_lock();
+    int done = arena_alloc_batch(arena,count,size,needed,out);
+    if(!done && arena!=&arenas[0]) {
+        arena_unlock(arena);
+        arena=&arenas[0];
+        pthread_mutex_lock(&arena->mtx);
+        done=arena_alloc_batch(arena,count,size,needed,out);
+    }
+    if(!done && quick_coalesce(arena,-1)) done=arena_alloc_batch(arena,count,size,needed,out);
+    // The grown tail chunk is big enough to be split after the last block.
+    if(!done && arena_grow(arena,needed+sizeof(struct chunk_t)+1)==0) done=arena_alloc_batch(arena,count,size,needed,out);
+    arena_unlock(arena);
+    return done ? count : 0;
+}
+
+static int arena_alloc_batch(struct arena_t *arena, size_t count, size_t size, size_t needed, void **out) {
+    // Writes the control blocks of all blocks at once, instead of splitting the free chunk count times.
+    // The part of the chunk left after the last block becomes a free chunk, or a part of the last block if it's too small.
+    struct chunk_t *chunk = find_free_chunk(arena,needed);
+    if(chunk==NULL) return 0;
+    freelist_remove(chunk);
+    struct heap_t *heap = &arena->heap;
+    struct chunk_t *prev = chunk->prev;
+    struct chunk_t *next = chunk->next;
+    size_t remainder=chunk->size-needed;
+    struct chunk_t *block = chunk;
+    for(size_t i=0; i<count; i++) {
+        block = (struct chunk_t *)((char*)chunk+i*(size+sizeof(struct chunk_t)));
+        FENCES_SET(block);
+        block->alloc=1;
+        block->debug=0;
+        block->size=size;
+        block->prev=prev;
+        if(prev && prev!=chunk->prev) {
+            prev->next=block;
+            CHUNK_CHECKSUM_UPDATE(prev);
+        }
+        if(i>0) pagemap_add(block);
+        out[i]=(char*)block+sizeof(struct chunk_t);
+        prev=block;
+    }
+    heap->chunks+=count-1;
+    if(remainder>=sizeof(struct chunk_t)) {
+        struct chunk_t *cut = (struct chunk_t *)((char*)block+sizeof(struct chunk_t)+size);
+        memset(cut,0,sizeof(struct chunk_t));
+        FENCES_SET(cut);
+        cut->size=remainder-sizeof(struct chunk_t);
+        cut->prev=block;
+        block->next=cut;
+        pagemap_add(cut);
+        freelist_insert(cut);
+        heap->chunks++;
+        block=cut;
+    }
+    else {
+        block->size+=remainder;
+        if(remainder) wasted_tail_count(arena,remainder);
+    }
+    used_size_update(arena,size,count-1);
+    used_size_update(arena,prev->size,1); // the last block, with the remainder if it's too small to be split off
+    block->next=next;
+    if(next) {
+        next->prev=block;
+        CHUNK_CHECKSUM_UPDATE(next);
+    }
+    else heap->tail_chunk=block;
+    CHUNK_CHECKSUM_UPDATE(block);
+    if(block!=prev) CHUNK_CHECKSUM_UPDATE(prev);
+    ARENA_CHECKSUM_UPDATE(arena);
+    return 1;
 }
 
 void *heap_calloc_debug(size_t number, size_t size, int fileline, const char* filename) {
+    INSTRUMENT_START(start);
     size_t size_to_alloc = number*size;
-    struct chunk_t *p = heap_malloc_debug(size_to_alloc,fileline,filename);
-    if(p==NULL) return NULL;
-    memset(p,0,size_to_alloc);
+    struct chunk_t *p = malloc_internal(size_to_alloc,fileline,filename);
+    if(p!=NULL) memset(p,0,size_to_alloc);
+    INSTRUMENT_END(timed_malloc,start);
+    if(__atomic_load_n(&trace_active,__ATOMIC_RELAXED)) trace_record(trace_calloc,now_ns(),size_to_alloc,p,NULL);
     return p;
 }
 
 void *heap_realloc_debug(void *memblock, size_t size, int fileline, const char *filename) {
-    if(memblock==NULL) return heap_malloc_debug(size,fileline,filename);
+    INSTRUMENT_START(start);
+    if(!__atomic_load_n(&trace_active,__ATOMIC_RELAXED)) {
+        void *p = realloc_internal(memblock,size,fileline,filename);
+        INSTRUMENT_END(timed_realloc,start);
+        return p;
+    }
+    // Timed before the call, the old block may be reused by another thread as soon as it's freed.
+    uint64_t time=now_ns();
+    void *p = realloc_internal(memblock,size,fileline,filename);
+    INSTRUMENT_END(timed_realloc,start);
+    trace_record(trace_realloc,time,size,p,memblock);
+    return p;
+}
+
+static void *realloc_internal(void *memblock, size_t size, int fileline, const char *filename) {
+    if(memblock==NULL) return malloc_internal(size,fileline,filename);
     if(size==0) {
         if(LOG) printf("-Log- Called realloc with size 0. A chunk will be freed.\n");
-        heap_free(memblock);
+        free_internal(memblock);
         return NULL;
     }
+    if(large_candidate(memblock)) {
+        void *p = large_realloc(memblock,size);
+        if(p!=NULL) realloc_count(&realloc_stats.remapped);
+        return p;
+    }
     struct chunk_t *chunk = (struct chunk_t *)((char*)memblock-sizeof(struct chunk_t));
-    if(chunk->size==size) return memblock;
-    
-    pthread_mutex_lock(&heap_mtx);
-    if(chunk->size>size+sizeof(struct chunk_t)) {
-        if(LOG) printf("-Log- Called realloc with smaller size than chunk's size. Splitting.\n");
-        split(chunk,size);
+    struct arena_t *arena = arena_of(chunk);
+    pthread_mutex_lock(&arena->mtx);
+    // Slab objects are looked up under the same lock as the resize, so the block can't change in between.
+    struct chunk_t *owner = pagemap_find(memblock);
+    if(owner!=NULL && owner->alloc==CHUNK_SLAB) {
+        struct slab_t *slab = slab_of(owner);
+        if(slab_pointer_type(slab,memblock)!=pointer_valid) {
+            arena_unlock(arena);
+            if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_realloc().\n");
+            return NULL;
+        }
+        size_t object_size=slab->object_size;
+        arena_unlock(arena);
+        if(size<=object_size) {
+            realloc_count(&realloc_stats.in_place_shrink);
+            return memblock;
+        }
+        if(LOG) printf("-Log- Moving a slab object to a bigger block.\n");
+        char *p = malloc_internal(size, fileline, filename);
+        if (p==NULL) return NULL;
+        memcpy(p,memblock,object_size);
+        free_internal(memblock);
+        realloc_count(&realloc_stats.copied);
+        return p;
+    }
+    if(chunk->size>=size) {
+        if(chunk->size>size+sizeof(struct chunk_t)) {
+            if(LOG) printf("-Log- Called realloc with smaller size than chunk's size. Splitting.\n");
+            split(chunk,size);
+        }
+        else if(chunk->size>size) wasted_tail_count(arena,chunk->size-size);
+        arena_unlock(arena);
+        realloc_count(&realloc_stats.in_place_shrink);
         return memblock;
     }
-    if(chunk->next && chunk->next->alloc==0 && chunk->next->size+chunk->size+sizeof(struct chunk_t)>size) {
+    // Blocks growing past the large threshold move to the mmap region.
+    int keep=!is_large(size);
+    struct chunk_t *next = chunk->next;
+    size_t next_size = next && next->alloc==0 ? next->size+sizeof(struct chunk_t) : 0;
+    if(keep && chunk->size+next_size>=size) {
         if(LOG) printf("-Log- Found a free chunk next to given memblock. Merging and splitting.\n");
-        merge(chunk,chunk->next,0);
+        merge(chunk,next,0);
         split(chunk,size);
+        arena_unlock(arena);
+        realloc_count(&realloc_stats.in_place_next);
         return memblock;
     }
+    if(keep && arena==&arenas[0] && (next==NULL || (next_size && next->next==NULL))) {
+        // The block ends the main heap (maybe followed by a free tail chunk), so the heap can grow behind it.
+        if(LOG) printf("-Log- Growing the heap behind the tail chunk.\n");
+        if(arena_grow(arena,size-chunk->size-next_size)==0) {
+            merge(chunk,chunk->next,0);
+            split(chunk,size);
+            arena_unlock(arena);
+            realloc_count(&realloc_stats.in_place_tail);
+            return memblock;
+        }
+        next_size=chunk->next && chunk->next->alloc==0 ? chunk->next->size+sizeof(struct chunk_t) : 0;
+    }
+    struct chunk_t *prev = chunk->prev;
+    if(keep && prev && prev->alloc==0 && prev->size+sizeof(struct chunk_t)+chunk->size+next_size>=size) {
+        if(LOG) printf("-Log- Found a free chunk before given memblock. Merging and moving the data.\n");
+        chunk=merge_backward(chunk);
+        if(chunk->next && chunk->next->alloc==0 && chunk->size<size) merge(chunk,chunk->next,0);
+        split(chunk,size);
+        arena_unlock(arena);
+        realloc_count(&realloc_stats.moved_prev);
+        return (char*)chunk+sizeof(struct chunk_t);
+    }
 
     if(LOG) printf("-Log- Using malloc-copy-free method.\n");
-    pthread_mutex_unlock(&heap_mtx);
+    size_t old_size=chunk->size;
+    arena_unlock(arena);
 
-    char *p = heap_malloc_debug(size, fileline, filename);
+    // The block is still the caller's, so it's copied without the lock.
+    char *p = malloc_internal(size, fileline, filename);
     if (p==NULL) return NULL;
-    pthread_mutex_lock(&heap_mtx);
-    memcpy(p,memblock,chunk->size);
-    pthread_mutex_unlock(&heap_mtx);
-    heap_free(memblock);
+    memcpy(p,memblock,old_size<size ? old_size : size);
+    free_internal(memblock);
+    realloc_count(&realloc_stats.copied);
     return p;
 }
 
+static struct chunk_t *merge_backward(struct chunk_t *chunk) {
+    // Joins an allocated chunk with the free chunk before it and moves the data to the start of the result.
+    // Called with the arena locked, returns the allocated chunk which replaced both.
+    struct arena_t *arena = arena_of(chunk);
+    struct chunk_t *prev = chunk->prev;
+    struct chunk_t *next = chunk->next;
+    size_t data_size = chunk->size;
+    const char *file=NULL;
+    int line=0;
+    if(chunk->debug) {
+        // Debug sites are keyed by the control block address.
+        pthread_mutex_lock(&debug_sites_mtx);
+        struct debug_site_t *site = debug_site_find(chunk);
+        if(site!=NULL) {
+            file=site->file;
+            line=site->line;
+        }
+        pthread_mutex_unlock(&debug_sites_mtx);
+        debug_site_remove(chunk);
+    }
+    freelist_remove(prev);
+    pagemap_remove(chunk);
+    used_size_update(arena,data_size,-1);
+    if(arena->heap.tail_chunk==chunk) arena->heap.tail_chunk=prev;
+    arena->heap.chunks--;
+    prev->size+=sizeof(struct chunk_t)+data_size;
+    prev->next=next;
+    if(next) {
+        next->prev=prev;
+        CHUNK_CHECKSUM_UPDATE(next);
+    }
+    prev->alloc=1;
+    used_size_update(arena,prev->size,1);
+    memmove((char*)prev+sizeof(struct chunk_t),(char*)chunk+sizeof(struct chunk_t),data_size);
+    debug_site_set(prev,line,file);
+    CHUNK_CHECKSUM_UPDATE(prev);
+    ARENA_CHECKSUM_UPDATE(arena);
+    return prev;
+}
+
+static void realloc_count(uint64_t *counter) {
+    __atomic_fetch_add(counter,1,__ATOMIC_RELAXED);
+}
+
+static int size_bucket(size_t size) {
+    int bucket = size ? 63-__builtin_clzll(size) : 0;
+    return bucket<SIZE_BUCKETS ? bucket : SIZE_BUCKETS-1;
+}
+
+static void used_size_update(struct arena_t *arena, size_t size, int64_t delta) {
+    // Called with the arena locked whenever a chunk becomes allocated or free, or an allocated one changes its size.
+    arena->used_sizes[size_bucket(size)]+=delta;
+}
+
+static void wasted_tail_count(struct arena_t *arena, size_t bytes) {
+    // Atomic, as thread caches hand out chunks without the arena lock.
+    __atomic_fetch_add(&arena->wasted_tails,1,__ATOMIC_RELAXED);
+    __atomic_fetch_add(&arena->wasted_tail_bytes,bytes,__ATOMIC_RELAXED);
+}
+
 // *alloc_aligned functions
 void *heap_malloc_aligned_debug(size_t count, int fileline, const char *filename) {
-    if(heap.pages<2) {
-        if(LOG) printf("-Log- Aligned malloc requires min. 2 chunks.\n");
+    return heap_malloc_aligned_ex_debug(count,PAGE_SIZE,fileline,filename);
+}
+
+void *heap_malloc_aligned_ex_debug(size_t count, size_t alignment, int fileline, const char *filename) {
+    // Alignment has to be a power of 2, smaller ones are raised to ALIGNMENT_MIN.
+    if(alignment==0 || (alignment&(alignment-1)) || alignment>ALIGNMENT_MAX) {
+        if(LOG) printf("-Log- Invalid alignment %lu.\n",alignment);
         return NULL;
     }
-    pthread_mutex_lock(&heap_mtx);
-    struct chunk_t *p = heap.head_chunk;
-    while(p) {
-        if(p->alloc==0) {
-            size_t dist = calc_dist(p);
-            if(!is_aligned(dist)) {
-                if(p->size==count) {
-                    if(LOG) printf("-Log- Found a needed chunk. Allocating.\n");
-                    p->alloc=1;
-                    p->debug_line=fileline;
-                    p->debug_file=filename;
-                    update_chunk_checksum(p);
-                    update_heap_data();
-                    pthread_mutex_unlock(&heap_mtx);
-                    return (void*)((char*)p+sizeof(struct chunk_t));
-                }
-                else if (p->size>count) {
-                    if(LOG) printf("-Log- Found a needed chunk, but with more size. Splitting and allocating.\n");
-                    struct chunk_t *res=NULL;
-                    res=split(p,count);
-                    if(res==NULL) {
-                        printf("Can't split a chunk.\n");
-                        pthread_mutex_unlock(&heap_mtx);
-                        return NULL;
-                    }
-                    res->alloc=1;
-                    res->debug_line=fileline;
-                    res->debug_file=filename;
-                    update_chunk_checksum(res);
-                    update_heap_data();
-                    pthread_mutex_unlock(&heap_mtx);
-                    return (void*)((char*)res+sizeof(struct chunk_t));
-                }
-            }
-            if(p->size>=count+2*sizeof(struct chunk_t)) {
-                size_t size_in_page = calc_size_in_page(p, dist);
-                if(p->size>=size_in_page) {
-                    size_t remainder = p->size-size_in_page;
-                    if(remainder>=count+sizeof(struct chunk_t) && size_in_page>=sizeof(struct chunk_t)) {
-                        if(LOG) printf("-Log- Found a needed chunk, but with more size. Splitting and allocating.\n");
-                        struct chunk_t *res=NULL;
-                        res=split(p,size_in_page-sizeof(struct chunk_t));
-                        if(res==NULL) {
-                            if(LOG) printf("-Log- Can't split a chunk.\n");
-                            pthread_mutex_unlock(&heap_mtx);
-                            return NULL;
-                        }
-                        res=split(res->next,count);
-                        if(res==NULL) {
-                            if(LOG) printf("-Log- Can't split a second chunk.\n");
-                            merge(p,p->next,1);
-                            pthread_mutex_unlock(&heap_mtx);
-                            return NULL;
-                        }
-                        res->alloc=1;
-                        res->debug_line=fileline;
-                        res->debug_file=filename;
-                        update_chunk_checksum(res);
-                        update_heap_data();
-                        pthread_mutex_unlock(&heap_mtx);
-                        return (void*)((char*)res+sizeof(struct chunk_t));
-                    }
-                    else if (remainder==count && size_in_page>=sizeof(struct chunk_t)) {
-                        if(LOG) printf("-Log- Found a needed chunk, but with more size. Splitting and allocating.\n");
-                        struct chunk_t *res=NULL;
-                        res=split(p,size_in_page-sizeof(struct chunk_t));
-                        if(res==NULL) {
-                            if(LOG) printf("-Log- Can't split a chunk.\n");
-                            pthread_mutex_unlock(&heap_mtx);
-                            return NULL;
-                        }
-                        if(res->next->size!=count) {
-                            if(LOG) printf("-Log- Something went wrong with splitting. Please validate a heap for more details.\n");
-                            merge(res,res->next,1);
-                            pthread_mutex_unlock(&heap_mtx);
-                            return NULL;
-                        }
-                        res->next->alloc=1;
-                        res->next->debug_line=fileline;
-                        res->next->debug_file=filename;
-                        update_chunk_checksum(res->next);
-                        update_heap_data();
-                        pthread_mutex_unlock(&heap_mtx);
-                        return (void*)((char*)res->next+sizeof(struct chunk_t));
-                    }
+    if(alignment<ALIGNMENT_MIN) alignment=ALIGNMENT_MIN;
+    INSTRUMENT_START(start);
+    struct arena_t *arena = arena_lock();
+    struct chunk_t *chunk = arena_alloc_aligned(arena,count,alignment,fileline,filename);
+    if(chunk==NULL && arena!=&arenas[0]) {
+        arena_unlock(arena);
+        arena=&arenas[0];
+        pthread_mutex_lock(&arena->mtx);
+        chunk=arena_alloc_aligned(arena,count,alignment,fileline,filename);
+    }
+    if(chunk==NULL && quick_coalesce(arena,-1)) chunk=arena_alloc_aligned(arena,count,alignment,fileline,filename);
+    if(chunk==NULL) {
+        // Any chunk this big fits, whatever its address.
+        if(LOG) printf("-Log- Aligned chunk not found. Asking for more space.\n");
+        size_t wanted=count+alignment+2*sizeof(struct chunk_t);
+        if(wanted>count && arena_grow(arena,wanted)==0) chunk=arena_alloc_aligned(arena,count,alignment,fileline,filename);
+    }
+    arena_unlock(arena);
+    INSTRUMENT_END(timed_malloc_aligned,start);
+    if(chunk==NULL) return NULL;
+    return (void*)((char*)chunk+sizeof(struct chunk_t));
+}
+
+static struct chunk_t *arena_alloc_aligned(struct arena_t *arena, size_t count, size_t alignment, int fileline, const char *filename) {
+    // Checks the first few chunks of every bin from the one of count up, until one of them fits once aligned.
+    // Beyond the bin of count+alignment+2*sizeof(struct chunk_t) every chunk fits, so the search stays bounded.
+    struct chunk_t *p = NULL;
+    size_t offset = 0;
+    int fli, sli;
+    freelist_mapping(count,&fli,&sli);
+    while(p==NULL && fli<FL_INDEX_COUNT) {
+        struct chunk_t *chunk_to_check = freelist_search(&arena->free_index,&fli,&sli);
+        if(chunk_to_check==NULL) break;
+        for(int i=0; chunk_to_check!=NULL && i<FREELIST_SCAN_LIMIT; i++) {
+            offset=calc_aligned_offset(chunk_to_check,alignment);
+            if(chunk_to_check->size>=offset+count) {
+                size_t remainder=chunk_to_check->size-offset-count;
+                if(remainder==0 || remainder>=sizeof(struct chunk_t)) {
+                    p=chunk_to_check;
+                    break;
                 }
             }
+            chunk_to_check=freelist_links(chunk_to_check)->next_free;
+        }
+        if(++sli==SL_INDEX_COUNT) {
+            sli=0;
+            fli++;
         }
+    }
+    if(p==NULL) {
+        if(LOG) printf("-Log- A needed chunk couldn't be found.\n");
+        return NULL;
+    }
+
+    if(offset) {
+        // The slack before the aligned block stays a free chunk.
+        if(LOG) printf("-Log- Found a chunk, splitting off %lu bytes before the aligned block.\n",offset);
+        split(p,offset-sizeof(struct chunk_t));
         p=p->next;
     }
-    if(LOG) printf("-Log- A needed chunk couldn't be found.\n");
-    pthread_mutex_unlock(&heap_mtx);
-    return NULL;
+    freelist_remove(p);
+    p->alloc=1;
+    used_size_update(arena,p->size,1);
+    if(p->size!=count) split(p,count);
+    debug_site_set(p,fileline,filename);
+    CHUNK_CHECKSUM_UPDATE(p);
+    ARENA_CHECKSUM_UPDATE(arena);
+    return p;
 }
 
 void *heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename) {
@@ -333,31 +896,49 @@ void *heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const
 void *heap_realloc_aligned_debug(void *memblock, size_t size, int fileline, const char *filename) {
     if(memblock==NULL) return heap_malloc_aligned_debug(size,fileline,filename);
     if(size==0) {
-        heap_free(memblock);
+        free_internal(memblock);
         return NULL;
     }
+    size_t object_size = large_candidate(memblock) ? heap_get_block_size(memblock) : slab_object_size(memblock);
+    if(object_size) {
+        // Slab objects and large blocks are never page-aligned.
+        char *p = heap_malloc_aligned_debug(size, fileline, filename);
+        if (p==NULL) return NULL;
+        memcpy(p,memblock,object_size<size ? object_size : size);
+        free_internal(memblock);
+        return p;
+    }
     struct chunk_t *chunk = (struct chunk_t *)((char*)memblock-sizeof(struct chunk_t));
     if(chunk->size==size) return memblock;
-    size_t dist = calc_dist(chunk);
-    if(!is_aligned(dist) && chunk->size>size+sizeof(struct chunk_t)) {
+    struct arena_t *arena = arena_of(chunk);
+    pthread_mutex_lock(&arena->mtx);
+    int aligned=((uintptr_t)memblock&(PAGE_SIZE-1))==0;
+    if(aligned && chunk->size>size+sizeof(struct chunk_t)) {
         if(LOG) printf("-Log- Found a chunk, but with more size. Splitting.\n");
         split(chunk,size);
+        arena_unlock(arena);
+        return memblock;
+    }
+    if(aligned && chunk->size>size) {
+        wasted_tail_count(arena,chunk->size-size);
+        arena_unlock(arena);
         return memblock;
     }
-    if(!is_aligned(dist) && chunk->next && chunk->next->alloc==0 && chunk->next->size+chunk->size+sizeof(struct chunk_t)>size) {
+    if(aligned && chunk->next && chunk->next->alloc==0 && chunk->next->size+chunk->size+sizeof(struct chunk_t)>size) {
         if(LOG) printf("-Log- Found a chunk next to given memblock. Merging.\n");
         merge(chunk,chunk->next,0);
         split(chunk,size);
+        arena_unlock(arena);
         return memblock;
     }
+    size_t old_size=chunk->size;
+    arena_unlock(arena);
 
     if(LOG) printf("-Log- Trying malloc-copy-free method.\n");
     char *p = heap_malloc_aligned_debug(size, fileline, filename);
     if (p==NULL) return NULL;
-    pthread_mutex_lock(&heap_mtx);
-    memcpy(p,memblock,chunk->size);
-    pthread_mutex_unlock(&heap_mtx);
-    heap_free(memblock);
+    memcpy(p,memblock,old_size<size ? old_size : size);
+    free_internal(memblock);
     return p;
 }
 
@@ -374,6 +955,9 @@ void *heap_realloc(void *memblock, size_t size) {
 void *heap_malloc_aligned(size_t count) {
     return heap_malloc_aligned_debug(count,0,NULL);
 }
+void *heap_malloc_aligned_ex(size_t count, size_t alignment) {
+    return heap_malloc_aligned_ex_debug(count,alignment,0,NULL);
+}
 void *heap_calloc_aligned(size_t number, size_t size) {
     return heap_calloc_aligned_debug(number,size,0,NULL);
 }
@@ -383,41 +967,325 @@ void *heap_realloc_aligned(void* memblock, size_t size) {
 
 // Chunk management functions
 void heap_free(void* memblock) {
-    pthread_mutex_lock(&heap_mtx);
+    // Recorded before the block is freed, so that it comes before any reuse of the address.
+    if(__atomic_load_n(&trace_active,__ATOMIC_RELAXED) && memblock) trace_record(trace_free,now_ns(),0,memblock,NULL);
+    INSTRUMENT_START(start);
+    free_internal(memblock);
+    INSTRUMENT_END(timed_free,start);
+}
+
+static void free_internal(void* memblock) {
+    if(large_candidate(memblock)) {
+        large_free(memblock,0);
+        return;
+    }
+    if(tcache_put(memblock)) return;
+    struct arena_t *arena = arena_of(memblock);
+    if(pthread_mutex_trylock(&arena->mtx)!=0) {
+        // The lock holder frees the block for us, unless it isn't a plain chunk.
+        if(remote_free_push(arena,memblock)) {
+            if(pthread_mutex_trylock(&arena->mtx)==0) arena_unlock(arena);
+            return;
+        }
+        pthread_mutex_lock(&arena->mtx);
+    }
     if(get_pointer_type(memblock)!=pointer_valid) {
         if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_free().\n");
-        pthread_mutex_unlock(&heap_mtx);
+        arena_unlock(arena);
         return;
     }
-    struct chunk_t *chunk = (struct chunk_t *)((char*)memblock-sizeof(struct chunk_t));
+    struct chunk_t *chunk = pagemap_find(memblock);
+    if(chunk->alloc==CHUNK_SLAB) slab_free(chunk,memblock);
+    else free_chunk(chunk);
+    if(LOG) printf("-Log- A block is successfully freed.\n");
+    arena_unlock(arena);
+}
+
+void heap_free_sized(void *memblock, size_t size) {
+    if(__atomic_load_n(&trace_active,__ATOMIC_RELAXED) && memblock) trace_record(trace_free,now_ns(),0,memblock,NULL);
+    INSTRUMENT_START(start);
+    free_sized_internal(memblock,size);
+    INSTRUMENT_END(timed_free,start);
+}
+
+static void free_sized_internal(void *memblock, size_t size) {
+    // heap_free() for callers which know the size they asked for. The control block is checked against it and
+    // against the page map instead of classifying the pointer first. Debug builds (without NDEBUG) classify it as well.
+    if(memblock==NULL) return;
+    if(large_candidate(memblock)) {
+        large_free(memblock,size);
+        return;
+    }
+    char *p = (char*)memblock;
+    if(!arenas[0].heap.is_set || p<region_start+sizeof(struct chunk_t)
+        || p>=(char*)arenas[0].heap.data+(size_t)__atomic_load_n(&arenas[0].heap.pages,__ATOMIC_RELAXED)*PAGE_SIZE) {
+        if(LOG) printf("-Log- A pointer is out of heap and can't be used in heap_free_sized().\n");
+        return;
+    }
+    struct arena_t *arena = arena_of(p);
+    if(size>0 && size<=heap_config.slab_max_size) {
+        // Slab objects have no control block, the page map tells if there's a slab under the pointer.
+        pthread_mutex_lock(&arena->mtx);
+        struct chunk_t *owner = pagemap_find(p);
+        if(owner!=NULL && owner->alloc==CHUNK_SLAB) {
+            struct slab_t *slab = slab_of(owner);
+            if(slab_pointer_type(slab,p)==pointer_valid && (size-1)/SLAB_CLASS_SIZE==slab->size_class) slab_free(owner,p);
+            else if(LOG) printf("-Log- Size %lu doesn't match the slab object, it isn't freed.\n",size);
+            arena_unlock(arena);
+            return;
+        }
+        arena_unlock(arena);
+    }
+
+    // A block may be a little bigger than asked for, when the rest was too small to be split off.
+    struct chunk_t *chunk = (struct chunk_t *)(p-sizeof(struct chunk_t));
+    if(!FENCES_VALID(chunk) || chunk->alloc!=1
+        || size>chunk->size || chunk->size-size>sizeof(struct chunk_t)) {
+        if(LOG) printf("-Log- Size %lu doesn't match the block, it isn't freed.\n",size);
+        return;
+    }
+    // With slabs the block has to be checked against the page map, which the thread cache can't do without the lock.
+    // Queued blocks are checked by the lock holder.
+    if(heap_config.slab_max_size<=0 && tcache_put(memblock)) return;
+    if(pthread_mutex_trylock(&arena->mtx)!=0) {
+        if(remote_free_push(arena,memblock)) {
+            if(pthread_mutex_trylock(&arena->mtx)==0) arena_unlock(arena);
+            return;
+        }
+        pthread_mutex_lock(&arena->mtx);
+    }
+#ifndef NDEBUG
+    if(get_pointer_type(memblock)!=pointer_valid) {
+        if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_free_sized().\n");
+        arena_unlock(arena);
+        return;
+    }
+#endif
+    // Checked again under the lock, another thread may have freed the block meanwhile. The bytes before a slab
+    // object may look like the control block of an allocated chunk, so the page map has to agree.
+    if(pagemap_find(p)==chunk && chunk->alloc==1) free_chunk(chunk);
+    else if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_free_sized().\n");
+    arena_unlock(arena);
+}
+
+static int pointer_compare(const void *a, const void *b) {
+    uintptr_t p1=(uintptr_t)*(void * const *)a, p2=(uintptr_t)*(void * const *)b;
+    return (p1>p2)-(p1<p2);
+}
+
+void heap_free_batch(void **ptrs, size_t n) {
+    if(__atomic_load_n(&trace_active,__ATOMIC_RELAXED) && ptrs) {
+        uint64_t time=now_ns();
+        for(size_t i=0; i<n; i++) if(ptrs[i]) trace_record(trace_free,time,0,ptrs[i],NULL);
+    }
+    free_batch_internal(ptrs,n);
+}
+
+static void free_batch_internal(void **ptrs, size_t n) {
+    // Frees n blocks, locking every arena once. The pointers are sorted in place by address, so that
+    // runs of neighbouring blocks become one free chunk in a single pass. Invalid pointers are skipped.
+    if(ptrs==NULL || n==0) return;
+    qsort(ptrs,n,sizeof(void*),pointer_compare);
+    size_t i=0;
+    while(i<n) {
+        if(ptrs[i]==NULL) {
+            i++;
+            continue;
+        }
+        if(large_candidate(ptrs[i])) {
+            large_free(ptrs[i++],0);
+            continue;
+        }
+        struct arena_t *arena = arena_of(ptrs[i]);
+        pthread_mutex_lock(&arena->mtx);
+        while(i<n && arena_of(ptrs[i])==arena && !large_candidate(ptrs[i])) {
+            if(get_pointer_type(ptrs[i])!=pointer_valid) {
+                if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_free_batch().\n");
+                i++;
+                continue;
+            }
+            struct chunk_t *chunk = pagemap_find(ptrs[i++]);
+            if(chunk->alloc==CHUNK_SLAB) {
+                slab_free(chunk,ptrs[i-1]);
+                continue;
+            }
+            if(chunk->debug) debug_site_remove(chunk);
+            used_size_update(arena,chunk->size,-1);
+            if(chunk->prev && chunk->prev->alloc==0) {
+                struct chunk_t *prev = chunk->prev;
+                freelist_remove(prev);
+                absorb_next(prev);
+                chunk=prev;
+            }
+            // Free chunks after it are taken along with the following blocks of the batch.
+            while(chunk->next) {
+                struct chunk_t *next = chunk->next;
+                if(next->alloc==0) freelist_remove(next);
+                else if(next->alloc!=1 || i==n || ptrs[i]!=(char*)next+sizeof(struct chunk_t)) break;
+                else {
+                    if(next->debug) debug_site_remove(next);
+                    used_size_update(arena,next->size,-1);
+                    i++;
+                }
+                absorb_next(chunk);
+            }
+            chunk->alloc=0;
+            freelist_insert(chunk);
+            CHUNK_CHECKSUM_UPDATE(chunk);
+            if(chunk->next==NULL) heap_trim(arena);
+        }
+        ARENA_CHECKSUM_UPDATE(arena);
+        arena_unlock(arena);
+    }
+}
+
+static void absorb_next(struct chunk_t *chunk) {
+    // Like merge(), but leaves the free chunk index alone: the caller keeps both chunks out of it.
+    struct arena_t *arena = arena_of(chunk);
+    struct chunk_t *next = chunk->next;
+    pagemap_remove(next);
+    if(arena->heap.tail_chunk==next) arena->heap.tail_chunk=chunk;
+    chunk->size+=next->size+sizeof(struct chunk_t);
+    chunk->next=next->next;
+    if(chunk->next) {
+        chunk->next->prev=chunk;
+        CHUNK_CHECKSUM_UPDATE(chunk->next);
+    }
+    arena->heap.chunks--;
+}
+
+static void free_chunk(struct chunk_t *chunk) {
+    // Frees an allocated chunk, parking it on a quick list if its size may be asked for again soon.
+    if(!quick_put(chunk)) release_chunk(chunk);
+}
+
+static void release_chunk(struct chunk_t *chunk) {
+    // Frees an allocated, cached or parked chunk and merges it with its free neighbours. Called with its arena locked.
+    if(chunk->alloc==1 || chunk->alloc==CHUNK_CACHED) {
+        if(chunk->debug) debug_site_remove(chunk);
+        used_size_update(arena_of(chunk),chunk->size,-1);
+    }
     chunk->alloc=0;
+    freelist_insert(chunk);
 
     if(chunk->prev!=NULL && chunk->prev->alloc==0) chunk=merge(chunk->prev,chunk,1);
     if(chunk->next!=NULL && chunk->next->alloc==0) chunk=merge(chunk,chunk->next,1);
 
-    update_chunk_checksum(chunk);
-    update_heap_data();
-    if(LOG) printf("-Log- A block is successfully freed.\n");
-    pthread_mutex_unlock(&heap_mtx);
+    CHUNK_CHECKSUM_UPDATE(chunk);
+    ARENA_CHECKSUM_UPDATE(arena_of(chunk));
+    if(chunk->next==NULL) heap_trim(arena_of(chunk));
+}
+
+static void heap_trim(struct arena_t *arena) {
+    // Gives the free pages at the end of the main heap back to custom_sbrk() once there are trim_threshold of them.
+    // Half of the threshold stays, so that alternating frees and allocations don't make the heap shrink and grow each time.
+    if(arena!=&arenas[0] || heap_config.trim_threshold<=0) return;
+    struct heap_t *heap = &arena->heap;
+    struct chunk_t *tail = heap->tail_chunk;
+    size_t threshold=(size_t)heap_config.trim_threshold*PAGE_SIZE;
+    if(tail->alloc || tail->size<threshold) return;
+    int release_pages=(tail->size-threshold/2)/PAGE_SIZE;
+    if(heap->pages-release_pages<PAGES_BGN) release_pages=heap->pages-PAGES_BGN;
+    if(release_pages<=0) return;
+    INSTRUMENT_COUNT(sbrk_calls,1);
+    if(custom_sbrk(-(intptr_t)release_pages*PAGE_SIZE)==(void*)-1) {
+        if(LOG) printf("-Log- sbrk() error.\n");
+        return;
+    }
+    freelist_remove(tail);
+    tail->size-=(size_t)release_pages*PAGE_SIZE;
+    freelist_insert(tail);
+    heap->pages-=release_pages;
+    if(LOG) printf("-Log- Pages decreased to %d.\n",heap->pages);
+    CHUNK_CHECKSUM_UPDATE(tail);
+    arena_update_end_fence(arena);
+}
+
+static int quick_put(struct chunk_t *chunk) {
+    // Parks a chunk being freed on the quick list of its size class, without merging it. Returns 1 if it was taken.
+    // A full list is merged first, so that parked chunks don't keep fragmenting the arena.
+    if(heap_config.quick_list_count<=0 || chunk->size>QUICK_MAX_SIZE || chunk->size<sizeof(struct chunk_t *)) return 0;
+    struct arena_t *arena = arena_of(chunk);
+    int bin=(chunk->size-1)/QUICK_CLASS_SIZE;
+    if(arena->quick_counts[bin]>=heap_config.quick_list_count) quick_coalesce(arena,bin);
+    if(chunk->debug) debug_site_remove(chunk);
+    used_size_update(arena,chunk->size,-1);
+    chunk->alloc=CHUNK_QUICK;
+    *tcache_link(chunk)=arena->quick[bin];
+    arena->quick[bin]=chunk;
+    arena->quick_counts[bin]++;
+    arena->quick_chunks++;
+    arena->quick_bytes+=chunk->size;
+    CHUNK_CHECKSUM_UPDATE(chunk);
+    return 1;
+}
+
+static struct chunk_t *quick_get(struct arena_t *arena, size_t count) {
+    // Takes a parked chunk of count's size class big enough for it, most recently freed first.
+    if(arena->quick_chunks==0 || count==0 || count>QUICK_MAX_SIZE) return NULL;
+    int bin=(count-1)/QUICK_CLASS_SIZE;
+    for(struct chunk_t **link=&arena->quick[bin]; *link; link=tcache_link(*link)) {
+        if((*link)->size>=count) {
+            struct chunk_t *chunk = *link;
+            *link=*tcache_link(chunk);
+            arena->quick_counts[bin]--;
+            arena->quick_chunks--;
+            arena->quick_bytes-=chunk->size;
+            chunk->alloc=1;
+            used_size_update(arena,chunk->size,1);
+            // The rest of a bigger chunk is too small to be split off, as for split().
+            if(chunk->size>count) wasted_tail_count(arena,chunk->size-count);
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+static int quick_coalesce(struct arena_t *arena, int bin) {
+    // Merges the parked chunks of a quick list (of all of them if bin is -1) with their free neighbours.
+    // Returns the number of chunks merged. Called with the arena locked.
+    int merged=0;
+    for(int i = bin<0 ? 0 : bin; i<(bin<0 ? QUICK_CLASSES : bin+1); i++) {
+        while(arena->quick[i]) {
+            struct chunk_t *chunk = arena->quick[i];
+            arena->quick[i]=*tcache_link(chunk);
+            arena->quick_bytes-=chunk->size;
+            release_chunk(chunk);
+            merged++;
+        }
+        arena->quick_chunks-=arena->quick_counts[i];
+        arena->quick_counts[i]=0;
+    }
+    return merged;
 }
 
 struct chunk_t *merge(struct chunk_t *chunk1, struct chunk_t *chunk2, char safe_mode) {
     if(chunk1==NULL || chunk2==NULL) return NULL;
     if(chunk2->next==chunk1) return merge(chunk2, chunk1, safe_mode);
     if(chunk1->next!=chunk2) return NULL;
-    if((safe_mode==1 && chunk1->alloc==1) || chunk2->alloc==1) return NULL;
+    if((safe_mode==1 && chunk1->alloc!=0) || chunk2->alloc!=0) return NULL;
     if(LOG) printf("-Log- Merging %p (%ld) with %p (%ld)\n",chunk1,chunk1->size,chunk2,chunk2->size);
+    INSTRUMENT_START(start);
+    struct arena_t *arena = arena_of(chunk1);
 
+    if(chunk1->alloc==0) freelist_remove(chunk1);
+    else used_size_update(arena,chunk1->size,-1);
+    freelist_remove(chunk2);
+    pagemap_remove(chunk2);
+    if(arena->heap.tail_chunk==chunk2) arena->heap.tail_chunk=chunk1;
     chunk1->size=chunk1->size+chunk2->size+sizeof(struct chunk_t);
+    if(chunk1->alloc==1) used_size_update(arena,chunk1->size,1);
     chunk1->next=chunk2->next;
     if(chunk1->next) {
         chunk1->next->prev=chunk1;
-        update_chunk_checksum(chunk1->next);
+        CHUNK_CHECKSUM_UPDATE(chunk1->next);
     }
-    heap.chunks--;
-    update_heap_data();
-    update_chunk_checksum(chunk1);
+    arena->heap.chunks--;
+    if(chunk1->alloc==0) freelist_insert(chunk1);
+    ARENA_CHECKSUM_UPDATE(arena);
+    CHUNK_CHECKSUM_UPDATE(chunk1);
     if(LOG) printf("-Log- Merged %p (%ld)\n",chunk1,chunk1->size);
+    INSTRUMENT_END(timed_merge,start);
     return chunk1;
 }
 struct chunk_t *split(struct chunk_t *chunk_to_split, size_t size) {
@@ -426,13 +1294,20 @@ struct chunk_t *split(struct chunk_t *chunk_to_split, size_t size) {
         if(LOG) printf("-Log- Given size is bigger than chunk's size. Aborting.\n");
         return NULL;
     }
+    struct arena_t *arena = arena_of(chunk_to_split);
+    if(chunk_to_split->size-size<sizeof(struct chunk_t)) {
+        if(LOG) printf("-Log- No space for a control block of the cut. Aborting.\n");
+        if(chunk_to_split->alloc==1) wasted_tail_count(arena,chunk_to_split->size-size);
+        return NULL;
+    }
+    INSTRUMENT_START(start);
+    if(chunk_to_split->alloc==0) freelist_remove(chunk_to_split);
+    else if(chunk_to_split->alloc==1) used_size_update(arena,chunk_to_split->size,-1);
     struct chunk_t cut;
     cut.size=chunk_to_split->size-size-sizeof(struct chunk_t);
-    cut.first_fence=FIRFENCE;
-    cut.second_fence=SECFENCE;
+    FENCES_SET(&cut);
     cut.alloc=0;
-    cut.debug_file=NULL;
-    cut.debug_line=0;
+    cut.debug=0;
     cut.prev=chunk_to_split;
     cut.next=chunk_to_split->next;
     
@@ -441,182 +1316,1472 @@ struct chunk_t *split(struct chunk_t *chunk_to_split, size_t size) {
     memcpy(cut_p,&cut,sizeof(struct chunk_t));
     if(TESTING) printf("-Testing- split(): after memcpy\n");
     chunk_to_split->size=size;
+    if(chunk_to_split->alloc==1) used_size_update(arena,size,1);
     chunk_to_split->next=cut_p;
-    heap.chunks++;
+    if(arena->heap.tail_chunk==chunk_to_split) arena->heap.tail_chunk=cut_p;
+    arena->heap.chunks++;
+    freelist_insert(cut_p);
+    pagemap_add(cut_p);
+    if(chunk_to_split->alloc==0) freelist_insert(chunk_to_split);
     if(cut_p->next) {
+        cut_p->next->prev=cut_p;
         if (cut_p->next->alloc==0) merge(cut_p,cut_p->next,1);
-        else {
-            cut_p->next->prev=cut_p;
-            update_chunk_checksum(cut_p->next);
-        }
+        else CHUNK_CHECKSUM_UPDATE(cut_p->next);
     }
-    update_chunk_checksum(cut_p);
-    update_chunk_checksum(chunk_to_split);
-    update_heap_data();
-    update_heap_checksum();
+    CHUNK_CHECKSUM_UPDATE(cut_p);
+    CHUNK_CHECKSUM_UPDATE(chunk_to_split);
+    ARENA_CHECKSUM_UPDATE(arena);
+    INSTRUMENT_END(timed_split,start);
     return chunk_to_split;
 }
 
-void *find_free_chunk(size_t size) {
-    struct chunk_t *chunk_to_check=heap.head_chunk;
-    size_t best_fit_size=-1;
+void *find_free_chunk(struct arena_t *arena, size_t size) {
+    // A chunk fits if its size is equal to the wanted one or if it can be split (the cut needs its own control block).
+    size_t split_size=size+sizeof(struct chunk_t)+1;
     struct chunk_t *best_fit=NULL;
-    while(chunk_to_check!=NULL) {
-        if(chunk_to_check->alloc==0) {
-            if((chunk_to_check->size)>(size+sizeof(struct chunk_t))) {
-                if(best_fit_size==-1 || best_fit_size>(chunk_to_check->size)) {
-                    best_fit_size=chunk_to_check->size;
-                    best_fit=chunk_to_check;
-                }
-            }
-            else if(chunk_to_check->size==size) {
+    INSTRUMENT_COUNT(find_free_calls,1);
+    int fli, sli, last_fli, last_sli;
+    freelist_mapping(size,&fli,&sli);
+    freelist_mapping(split_size,&last_fli,&last_sli);
+
+    // Bins between the exact one and the split one hold chunks of both kinds, check a few of each.
+    while(fli<last_fli || (fli==last_fli && sli<=last_sli)) {
+        struct chunk_t *chunk_to_check=freelist_search(&arena->free_index,&fli,&sli);
+        if(chunk_to_check==NULL) break;
+        if(fli>last_fli || (fli==last_fli && sli>last_sli)) break;
+        for(int i=0; chunk_to_check!=NULL && i<FREELIST_SCAN_LIMIT; i++) {
+            INSTRUMENT_COUNT(find_free_inspected,1);
+            if(chunk_to_check->size==size) {
                 if(LOG) printf("-Log- Found chunk with size %lu\n", size);
                 return chunk_to_check;
             }
+            if(chunk_to_check->size>=split_size && (best_fit==NULL || best_fit->size>chunk_to_check->size)) best_fit=chunk_to_check;
+            chunk_to_check=freelist_links(chunk_to_check)->next_free;
+        }
+        if(best_fit!=NULL) break;
+        if(++sli==SL_INDEX_COUNT) {
+            sli=0;
+            fli++;
         }
-        chunk_to_check=chunk_to_check->next;
     }
-    if(LOG && best_fit!=NULL) printf("-Log- Found chunk with size %lu\n",best_fit->size);
-    return best_fit;
-}
 
-// Heap control functions
-enum pointer_type_t get_pointer_type(const void* pointer) {
-    if(pointer==NULL) return pointer_null;
-    char *p = (char*)pointer; // to perform pointer arithmetic
-    if(p<(char*)heap.data || p>=((char*)heap.tail_chunk+heap.tail_chunk->size+sizeof(struct chunk_t)+sizeof(int))) return pointer_out_of_heap;
-    if(p>=(char*)heap.end_fence_p && p<(char*)heap.end_fence_p+sizeof(int)) return pointer_end_fence;
-    struct chunk_t *i=heap.head_chunk;
-    while(i!=NULL) {
-        if(p>=(char*)i && p<(char*)i+sizeof(struct chunk_t)+i->size) {
-            if(p>=(char*)i && p<(char*)i+sizeof(struct chunk_t)) return pointer_control_block;
-            if(i->alloc==0) return pointer_unallocated;
-            if(p==(char*)i+sizeof(struct chunk_t)) return pointer_valid;
-            return pointer_inside_data_block;
+    // Every chunk above the split bin is large enough, take the smallest of the first few in the lowest non-empty bin.
+    if(best_fit==NULL) {
+        fli=last_fli;
+        sli=last_sli+1;
+        if(sli==SL_INDEX_COUNT) {
+            sli=0;
+            fli++;
+        }
+        struct chunk_t *chunk_to_check=fli<FL_INDEX_COUNT ? freelist_search(&arena->free_index,&fli,&sli) : NULL;
+        for(int i=0; chunk_to_check!=NULL && i<FREELIST_SCAN_LIMIT; i++) {
+            INSTRUMENT_COUNT(find_free_inspected,1);
+            if(chunk_to_check->size>=split_size && (best_fit==NULL || best_fit->size>chunk_to_check->size)) best_fit=chunk_to_check;
+            chunk_to_check=freelist_links(chunk_to_check)->next_free;
         }
-        i=i->next;
     }
-    return pointer_out_of_heap;
+    if(LOG && best_fit!=NULL) printf("-Log- Found chunk with size %lu\n",best_fit->size);
+    return best_fit;
 }
 
-void update_heap_data() {
-    struct chunk_t *ch = heap.head_chunk;
-    while(ch->next!=NULL) ch=ch->next;
-    heap.tail_chunk=ch;
+// Slab functions
+static struct slab_t *slab_of(struct chunk_t *chunk) {
+    return (struct slab_t *)((char*)chunk+sizeof(struct chunk_t));
+}
 
-    update_heap_checksum();
+static void slab_init(struct chunk_t *chunk, int size_class) {
+    // Turns an allocated chunk of SLAB_SIZE bytes into an empty slab. Called with the arena locked.
+    struct arena_t *arena = arena_of(chunk);
+    used_size_update(arena,chunk->size,-1); // its objects are counted instead
+    chunk->alloc=CHUNK_SLAB;
+    CHUNK_CHECKSUM_UPDATE(chunk);
+    struct slab_t *slab = slab_of(chunk);
+    memset(slab,0,sizeof(struct slab_t));
+    if(INTEGRITY_FENCES) slab->fence=SLABFENCE;
+    slab->size_class=size_class;
+    slab->object_size=(size_class+1)*SLAB_CLASS_SIZE;
+    slab->objects=(char*)(((uintptr_t)(slab+1)+SLAB_CLASS_SIZE-1)&~(uintptr_t)(SLAB_CLASS_SIZE-1));
+    slab->capacity=((char*)slab+SLAB_SIZE-slab->objects)/slab->object_size;
+    for(int i=0; i<slab->capacity; i++) slab->free_map[i/64]|=1ULL<<(i%64);
+    slab->next=arena->slabs[size_class];
+    if(slab->next) slab->next->prev=slab;
+    arena->slabs[size_class]=slab;
+    arena->slab_count++;
+    arena->slab_free_bytes+=(size_t)slab->capacity*slab->object_size;
+    if(LOG) printf("-Log- New slab %p for %d B objects.\n",slab,slab->object_size);
 }
 
-void update_end_fence() {
-    pthread_mutex_lock(&heap_mtx);
-    int end_fence=LASFENCE;
-    int *end_fence_e=(int*)((char*)heap.tail_chunk+sizeof(struct chunk_t)+heap.tail_chunk->size);
-    if(TESTING) printf("-Testing- update_end_fence() before memcpy\n");
-    memcpy(end_fence_e,&end_fence,sizeof(int));
-    heap.end_fence_p=end_fence_e;
-    update_heap_checksum();
-    pthread_mutex_unlock(&heap_mtx);
+static void *slab_alloc(struct arena_t *arena, size_t count) {
+    // Takes the first free object of the size class, found with a bit scan. Called with the arena locked.
+    int size_class=(count-1)/SLAB_CLASS_SIZE;
+    if(arena->slabs[size_class]==NULL) {
+        struct chunk_t *chunk = arena_alloc(arena,SLAB_SIZE,0,NULL);
+        if(chunk==NULL) return NULL;
+        slab_init(chunk,size_class);
+    }
+    struct slab_t *slab = arena->slabs[size_class];
+    int word=0;
+    while(!slab->free_map[word]) word++;
+    int bit=__builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word]&=~(1ULL<<bit);
+    slab->used++;
+    if(slab->used==slab->capacity) {
+        // Full slabs leave the list until one of their objects is freed.
+        arena->slabs[size_class]=slab->next;
+        if(slab->next) slab->next->prev=NULL;
+        slab->next=NULL;
+    }
+    arena->slab_objects++;
+    arena->slab_free_bytes-=slab->object_size;
+    used_size_update(arena,slab->object_size,1);
+    return slab->objects+(size_t)(word*64+bit)*slab->object_size;
 }
 
-// Statistics functions
-void* heap_get_data_block_start(const void* pointer) {
-    enum pointer_type_t type = get_pointer_type(pointer);
-    if(type==pointer_valid) return (void*)pointer;
-    if(type!=pointer_inside_data_block) return NULL;
+static void slab_free(struct chunk_t *chunk, void *pointer) {
+    // Called with the arena locked, for a pointer that get_pointer_type() found valid.
+    struct arena_t *arena = arena_of(chunk);
+    struct slab_t *slab = slab_of(chunk);
+    size_t index=((char*)pointer-slab->objects)/slab->object_size;
+    if(slab->used==slab->capacity) {
+        slab->prev=NULL;
+        slab->next=arena->slabs[slab->size_class];
+        if(slab->next) slab->next->prev=slab;
+        arena->slabs[slab->size_class]=slab;
+    }
+    slab->free_map[index/64]|=1ULL<<(index%64);
+    slab->used--;
+    arena->slab_objects--;
+    arena->slab_free_bytes+=slab->object_size;
+    used_size_update(arena,slab->object_size,-1);
 
-    struct chunk_t *tmp = heap.head_chunk;
-    while(tmp) {
-        if((char*)pointer>=(char*)tmp && (char*)pointer<(char*)tmp+sizeof(struct chunk_t)+tmp->size) return (void*)((char*)tmp+sizeof(struct chunk_t));
-        tmp=tmp->next;
+    // Empty slabs go back to the heap, except the last one of a class (so a single object doesn't make it ping-pong).
+    if(slab->used==0 && (slab->prev!=NULL || slab->next!=NULL)) {
+        if(slab->prev) slab->prev->next=slab->next;
+        else arena->slabs[slab->size_class]=slab->next;
+        if(slab->next) slab->next->prev=slab->prev;
+        arena->slab_count--;
+        arena->slab_free_bytes-=(size_t)slab->capacity*slab->object_size;
+        chunk->alloc=1;
+        used_size_update(arena,chunk->size,1); // release_chunk() takes it off again
+        release_chunk(chunk);
     }
-    return NULL;
 }
 
-size_t heap_get_used_space(void) {
-    struct chunk_t *tmp = heap.head_chunk;
+static size_t slab_object_size(const void *pointer) {
+    // Size of the slab object at the pointer, 0 if it isn't one.
+    if(pointer==NULL) return 0;
+    struct arena_t *arena = arena_of(pointer);
     size_t size=0;
-    while(tmp) {
-        size+=sizeof(struct chunk_t);
-        if(tmp->alloc) size+=tmp->size;
-        tmp=tmp->next;
+    pthread_mutex_lock(&arena->mtx);
+    if(get_pointer_type(pointer)==pointer_valid) {
+        struct chunk_t *chunk = chunk_of(pointer);
+        if(chunk->alloc==CHUNK_SLAB) size=slab_of(chunk)->object_size;
     }
-    size+=sizeof(int); //size of the end fence
+    arena_unlock(arena);
     return size;
 }
-size_t heap_get_largest_used_block_size(void) {
-    struct chunk_t *tmp = heap.head_chunk;
-    size_t max=0;
-    while(tmp) {
-        if(tmp->alloc && tmp->size>max) max=tmp->size;
-        tmp=tmp->next;
-    }
-    return max;
+
+static enum pointer_type_t slab_pointer_type(struct slab_t *slab, const char *p) {
+    // The slab header counts as a control block, the space after the last object as unallocated.
+    if(p<slab->objects) return pointer_control_block;
+    size_t index=(p-slab->objects)/slab->object_size;
+    if(index>=slab->capacity || slab->free_map[index/64]&(1ULL<<(index%64))) return pointer_unallocated;
+    if((p-slab->objects)%slab->object_size==0) return pointer_valid;
+    return pointer_inside_data_block;
 }
 
-uint64_t heap_get_used_blocks_count(void) {
-    struct chunk_t *tmp = heap.head_chunk;
-    uint64_t count=0;
-    while(tmp) {
-        if(tmp->alloc) count++;
-        tmp=tmp->next;
-    }
-    return count;
+// Large block functions
+static int is_large(size_t count) {
+    return heap_config.large_threshold>0 && count>=(size_t)heap_config.large_threshold;
 }
 
-size_t heap_get_free_space(void) {
-    struct chunk_t *tmp = heap.head_chunk;
-    size_t size=0;
-    while(tmp) {
-        if(tmp->alloc==0) size+=tmp->size;
-        tmp=tmp->next;
-    }
-    return size;
+static size_t large_map_size(size_t count) {
+    // Pages taken by a large block and its control block.
+    return (count+sizeof(struct chunk_t)+PAGE_SIZE-1)/PAGE_SIZE*PAGE_SIZE;
 }
 
-size_t heap_get_largest_free_area(void) {
-    struct chunk_t *tmp = heap.head_chunk;
-    size_t max=0;
-    while(tmp) {
-        if(tmp->alloc==0 && tmp->size>max) max=tmp->size;
-        tmp=tmp->next;
-    }
-    return max;
+static int large_candidate(const void *pointer) {
+    // The mmap region lies above the main heap, which ends at the program break.
+    if(!__atomic_load_n(&large_count,__ATOMIC_RELAXED) || !arenas[0].heap.is_set) return 0;
+    char *heap_end = (char*)arenas[0].heap.data+(size_t)__atomic_load_n(&arenas[0].heap.pages,__ATOMIC_RELAXED)*PAGE_SIZE;
+    return (char*)pointer>=heap_end;
 }
 
-uint64_t heap_get_free_gaps_count(void) {
-    struct chunk_t *tmp = heap.head_chunk;
-    uint64_t count=0;
-    while(tmp) {
-        if(tmp->alloc==0 && tmp->size>=sizeof(void*)+sizeof(struct chunk_t)) count++;
-        tmp=tmp->next;
-    }
-    return count;
+static struct chunk_t *large_find(const void *pointer) {
+    // Called with large_mtx held. Returns the large block whose pages contain the pointer.
+    if((char*)pointer<region_start) return NULL;
+    size_t page=pagemap_page(pointer);
+    if(page>=PAGEMAP_PAGES) return NULL;
+    return page_map.large_block[page];
 }
 
-size_t heap_get_block_size(const void* memblock) {
-    if (get_pointer_type(memblock)!=pointer_valid) return 0;
-    struct chunk_t *tmp = heap_get_control_block(memblock);
-    return tmp->size;
+static void large_map_set(struct chunk_t *chunk, size_t map_size, struct chunk_t *block) {
+    // Points the page map entries of a mapping to block (NULL when it's unmapped). Called with large_mtx held.
+    size_t first=pagemap_page(chunk);
+    for(size_t page=first; page<first+map_size/PAGE_SIZE; page++) page_map.large_block[page]=block;
+}
+
+static void *large_alloc(size_t count, int fileline, const char *filename) {
+    // Maps pages for the block, they don't belong to any arena.
+    size_t map_size=large_map_size(count);
+    if(map_size<count) return NULL;
+    struct chunk_t *chunk = custom_mmap(map_size);
+    if(chunk==(void*)-1) return NULL;
+    if((char*)chunk<region_start || pagemap_page(chunk)+map_size/PAGE_SIZE>PAGEMAP_PAGES) {
+        // Out of reach of the page map, the block couldn't be found again.
+        custom_munmap(chunk,map_size);
+        return NULL;
+    }
+    memset(chunk,0,sizeof(struct chunk_t));
+    FENCES_SET(chunk);
+    chunk->alloc=CHUNK_LARGE;
+    chunk->size=count;
+
+    pthread_mutex_lock(&large_mtx);
+    chunk->next=large_head;
+    if(large_head) {
+        large_head->prev=chunk;
+        CHUNK_CHECKSUM_UPDATE(large_head);
+    }
+    large_head=chunk;
+    large_map_set(chunk,map_size,chunk);
+    __atomic_store_n(&large_count,large_count+1,__ATOMIC_RELAXED);
+    __atomic_store_n(&large_pages,large_pages+map_size/PAGE_SIZE,__ATOMIC_RELAXED);
+    debug_site_set(chunk,fileline,filename);
+    CHUNK_CHECKSUM_UPDATE(chunk);
+    pthread_mutex_unlock(&large_mtx);
+    if(LOG) printf("-Log- Mapped a large block %p (%lu).\n",chunk,count);
+    return (char*)chunk+sizeof(struct chunk_t);
+}
+
+static void *large_realloc(void *memblock, size_t size) {
+    // Resizes the mapping instead of copying the data. The block stays in the mmap region whatever its new size.
+    pthread_mutex_lock(&large_mtx);
+    struct chunk_t *chunk = large_find(memblock);
+    if(chunk==NULL || memblock!=(char*)chunk+sizeof(struct chunk_t)) {
+        pthread_mutex_unlock(&large_mtx);
+        if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_realloc().\n");
+        return NULL;
+    }
+    size_t old_map=large_map_size(chunk->size), new_map=large_map_size(size);
+    if(new_map<size) {
+        pthread_mutex_unlock(&large_mtx);
+        return NULL;
+    }
+    if(old_map!=new_map) {
+        // Debug sites are keyed by the control block address, which may change.
+        const char *file=NULL;
+        int line=0;
+        if(chunk->debug) {
+            pthread_mutex_lock(&debug_sites_mtx);
+            struct debug_site_t *site = debug_site_find(chunk);
+            if(site!=NULL) {
+                file=site->file;
+                line=site->line;
+            }
+            pthread_mutex_unlock(&debug_sites_mtx);
+            debug_site_remove(chunk);
+        }
+        struct chunk_t *moved = custom_mremap(chunk,old_map,new_map);
+        if(moved==(void*)-1) {
+            debug_site_set(chunk,line,file);
+            CHUNK_CHECKSUM_UPDATE(chunk);
+            pthread_mutex_unlock(&large_mtx);
+            if(LOG) printf("-Log- mremap() error.\n");
+            return NULL;
+        }
+        if(moved!=chunk) {
+            if(LOG) printf("-Log- A large block moved to %p.\n",moved);
+            if(moved->prev) {
+                moved->prev->next=moved;
+                CHUNK_CHECKSUM_UPDATE(moved->prev);
+            }
+            else large_head=moved;
+            if(moved->next) {
+                moved->next->prev=moved;
+                CHUNK_CHECKSUM_UPDATE(moved->next);
+            }
+        }
+        large_map_set(chunk,old_map,NULL);
+        large_map_set(moved,new_map,moved);
+        chunk=moved;
+        debug_site_set(chunk,line,file);
+        __atomic_store_n(&large_pages,large_pages-old_map/PAGE_SIZE+new_map/PAGE_SIZE,__ATOMIC_RELAXED);
+    }
+    chunk->size=size;
+    CHUNK_CHECKSUM_UPDATE(chunk);
+    pthread_mutex_unlock(&large_mtx);
+    return (char*)chunk+sizeof(struct chunk_t);
+}
+
+static void large_free(void *memblock, size_t size) {
+    // Size is 0 if the caller doesn't know it.
+    pthread_mutex_lock(&large_mtx);
+    struct chunk_t *chunk = large_find(memblock);
+    if(chunk==NULL || memblock!=(char*)chunk+sizeof(struct chunk_t)) {
+        pthread_mutex_unlock(&large_mtx);
+        if(LOG) printf("-Log- A pointer is not valid and can't be used in heap_free().\n");
+        return;
+    }
+    if(size!=0 && size!=chunk->size) {
+        pthread_mutex_unlock(&large_mtx);
+        if(LOG) printf("-Log- Size %lu doesn't match the block (%lu), it isn't freed.\n",size,chunk->size);
+        return;
+    }
+    large_unmap(chunk);
+    pthread_mutex_unlock(&large_mtx);
+    if(LOG) printf("-Log- A large block is successfully unmapped.\n");
+}
+
+static void large_unmap(struct chunk_t *chunk) {
+    // Called with large_mtx held. The pages go back right away.
+    if(chunk->debug) debug_site_remove(chunk);
+    if(chunk->prev) {
+        chunk->prev->next=chunk->next;
+        CHUNK_CHECKSUM_UPDATE(chunk->prev);
+    }
+    else large_head=chunk->next;
+    if(chunk->next) {
+        chunk->next->prev=chunk->prev;
+        CHUNK_CHECKSUM_UPDATE(chunk->next);
+    }
+    size_t map_size=large_map_size(chunk->size);
+    large_map_set(chunk,map_size,NULL);
+    __atomic_store_n(&large_count,large_count-1,__ATOMIC_RELAXED);
+    __atomic_store_n(&large_pages,large_pages-map_size/PAGE_SIZE,__ATOMIC_RELAXED);
+    if(custom_munmap(chunk,map_size)!=0 && LOG) printf("-Log- munmap() error.\n");
+}
+
+static enum pointer_type_t large_pointer_type(const char *p) {
+    // The slack after the data in the last page counts as unallocated.
+    enum pointer_type_t type = pointer_out_of_heap;
+    pthread_mutex_lock(&large_mtx);
+    struct chunk_t *chunk = large_find(p);
+    if(chunk!=NULL) {
+        char *data = (char*)chunk+sizeof(struct chunk_t);
+        if(p<data) type=pointer_control_block;
+        else if(p==data) type=pointer_valid;
+        else if(p<data+chunk->size) type=pointer_inside_data_block;
+        else type=pointer_unallocated;
+    }
+    pthread_mutex_unlock(&large_mtx);
+    return type;
+}
+
+static enum validation_code_t large_validate(void) {
+    enum validation_code_t ret = no_errors;
+    int count=0;
+    size_t pages=0;
+    pthread_mutex_lock(&large_mtx);
+    for(struct chunk_t *p=large_head, *prev=NULL; p && ret==no_errors; prev=p, p=p->next) {
+        if(INTEGRITY_FENCES && p->first_fence!=FIRFENCE) ret=err_chunk_fence1;
+        else if(INTEGRITY_FENCES && p->second_fence!=SECFENCE) ret=err_chunk_fence2;
+        else if(INTEGRITY_CHECKSUMS && verify_chunk_checksum(p)) ret=err_chunk_checksum;
+        else if(p->prev!=prev) ret=err_invalid_prev;
+        else if(p->alloc!=CHUNK_LARGE || large_find(p)!=p || large_find((char*)p+large_map_size(p->size)-1)!=p) ret=err_large_block;
+        else if(p->debug) {
+            pthread_mutex_lock(&debug_sites_mtx);
+            if(p->debug!=1 || debug_site_find(p)==NULL) ret=err_debug_site;
+            pthread_mutex_unlock(&debug_sites_mtx);
+        }
+        count++;
+        pages+=large_map_size(p->size)/PAGE_SIZE;
+    }
+    if(ret==no_errors && (count!=large_count || pages!=large_pages)) ret=err_large_block;
+    pthread_mutex_unlock(&large_mtx);
+    return ret;
+}
+
+static struct chunk_t *chunk_of(const void *pointer) {
+    // The chunk or large block whose control block or data block contains the pointer.
+    if(large_candidate(pointer)) {
+        pthread_mutex_lock(&large_mtx);
+        struct chunk_t *chunk = large_find(pointer);
+        pthread_mutex_unlock(&large_mtx);
+        return chunk;
+    }
+    return pagemap_find(pointer);
+}
+
+// Thread cache functions
+static struct chunk_t **tcache_link(struct chunk_t *chunk) {
+    return (struct chunk_t **)((char*)chunk+sizeof(struct chunk_t));
+}
+
+static void tcache_destructor(void *arg) {
+    // Drains the cache of an exiting thread back to the heap.
+    struct thread_cache_t *cache = arg;
+    if(cache->generation!=heap_generation || !arenas[0].heap.is_set) return;
+    for(int bin=0; bin<TCACHE_CLASSES; bin++) {
+        if(cache->counts[bin]) tcache_flush(cache,bin,cache->counts[bin]);
+    }
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&thread_cache_key,tcache_destructor);
+}
+
+static struct thread_cache_t *tcache_current(void) {
+    struct thread_cache_t *cache = &thread_cache;
+    if(!cache->registered) {
+        pthread_once(&thread_cache_key_once,tcache_make_key);
+        pthread_setspecific(thread_cache_key,cache);
+        cache->registered=1;
+    }
+    if(cache->generation!=heap_generation) {
+        // Chunks cached before heap_delete() don't exist anymore.
+        memset(cache->bins,0,sizeof(cache->bins));
+        memset(cache->counts,0,sizeof(cache->counts));
+        cache->generation=heap_generation;
+    }
+    return cache;
+}
+
+static struct chunk_t *tcache_get(size_t count) {
+    if(heap_config.thread_cache_count<=0 || count==0 || count>TCACHE_MAX_SIZE) return NULL;
+    struct thread_cache_t *cache = tcache_current();
+    int bin=(count-1)/TCACHE_CLASS_SIZE;
+    for(struct chunk_t **link=&cache->bins[bin]; *link; link=tcache_link(*link)) {
+        if((*link)->size>=count) {
+            struct chunk_t *chunk = *link;
+            *link=*tcache_link(chunk);
+            cache->counts[bin]--;
+            __atomic_store_n(&chunk->alloc,1,__ATOMIC_RELAXED);
+            if(chunk->size>count) wasted_tail_count(arena_of(chunk),chunk->size-count);
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+static struct chunk_t *unlocked_chunk(void *memblock) {
+    // The allocated chunk of a block, or NULL if it doesn't look like one. Without the arena lock, the control
+    // block is only read: neighbours' split() and merge() may update its prev pointer and checksum meanwhile.
+    if(!arenas[0].heap.is_set) return NULL;
+    // Without fences the bytes before a slab object may look like the control block of an allocated chunk.
+    if(!INTEGRITY_FENCES && heap_config.slab_max_size>0) return NULL;
+    char *p = (char*)memblock;
+    char *heap_end = (char*)arenas[0].heap.data+(size_t)__atomic_load_n(&arenas[0].heap.pages,__ATOMIC_RELAXED)*PAGE_SIZE;
+    if(p<region_start+sizeof(struct chunk_t) || p>=heap_end) return NULL;
+    struct chunk_t *chunk = (struct chunk_t *)(p-sizeof(struct chunk_t));
+    if(!FENCES_VALID(chunk) || chunk->alloc!=1) return NULL;
+    if(chunk->size<sizeof(struct chunk_t *)) return NULL;
+    return chunk;
+}
+
+static int chunk_claim(struct chunk_t *chunk) {
+    // Marks an allocated chunk as cached. Returns 0 if it isn't allocated anymore, so that of two threads
+    // freeing the same block only one takes it.
+    char expected=1;
+    return __atomic_compare_exchange_n(&chunk->alloc,&expected,CHUNK_CACHED,0,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED);
+}
+
+static int tcache_put(void *memblock) {
+    // Returns 1 if the block was taken by the cache.
+    if(heap_config.thread_cache_count<=0) return 0;
+    struct chunk_t *chunk = unlocked_chunk(memblock);
+    if(chunk==NULL || chunk->size>TCACHE_MAX_SIZE || chunk->debug) return 0;
+    // A block already in some thread's cache is no longer allocated, so heap_free() rejects it under the lock.
+    if(!chunk_claim(chunk)) {
+        if(LOG) printf("-Log- A block is being freed by another thread.\n");
+        return 1;
+    }
+
+    struct thread_cache_t *cache = tcache_current();
+    int bin=(chunk->size-1)/TCACHE_CLASS_SIZE;
+    if(cache->counts[bin]>=heap_config.thread_cache_count) tcache_flush(cache,bin,(heap_config.thread_cache_count+1)/2);
+    *tcache_link(chunk)=cache->bins[bin];
+    cache->bins[bin]=chunk;
+    cache->counts[bin]++;
+    return 1;
+}
+
+static void tcache_flush(struct thread_cache_t *cache, int bin, int count) {
+    // Gives back up to count chunks of a bin to the heap, locking an arena once for a run of its chunks.
+    struct arena_t *locked = NULL;
+    while(count-- && cache->bins[bin]) {
+        struct chunk_t *chunk = cache->bins[bin];
+        struct arena_t *arena = arena_of(chunk);
+        if(arena!=locked) {
+            if(locked) arena_unlock(locked);
+            pthread_mutex_lock(&arena->mtx);
+            locked=arena;
+        }
+        cache->bins[bin]=*tcache_link(chunk);
+        cache->counts[bin]--;
+        free_chunk(chunk);
+    }
+    if(locked) arena_unlock(locked);
+}
+
+void heap_thread_cache_flush(void) {
+    if(!arenas[0].heap.is_set) return;
+    struct thread_cache_t *cache = tcache_current();
+    for(int bin=0; bin<TCACHE_CLASSES; bin++) {
+        if(cache->counts[bin]) tcache_flush(cache,bin,cache->counts[bin]);
+    }
+}
+
+// Remote free functions
+static int remote_free_push(struct arena_t *arena, void *memblock) {
+    // Returns 1 if the block was queued for the holder of the arena lock. The queue is a stack linked
+    // through the blocks' data, so a push is one compare-and-swap.
+    struct chunk_t *chunk = unlocked_chunk(memblock);
+    if(chunk==NULL) return 0;
+    // A queued block is cached like one in a thread cache, so it can't be pushed twice.
+    if(!chunk_claim(chunk)) {
+        if(LOG) printf("-Log- A block is being freed by another thread.\n");
+        return 1;
+    }
+    struct chunk_t *head = __atomic_load_n(&arena->remote_frees,__ATOMIC_RELAXED);
+    do {
+        *tcache_link(chunk)=head;
+    } while(!__atomic_compare_exchange_n(&arena->remote_frees,&head,chunk,1,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED));
+    return 1;
+}
+
+static void remote_free_drain(struct arena_t *arena) {
+    // Frees the queued blocks. Called with the arena locked.
+    struct chunk_t *chunk = __atomic_exchange_n(&arena->remote_frees,NULL,__ATOMIC_ACQUIRE);
+    while(chunk) {
+        struct chunk_t *next = *tcache_link(chunk);
+        char *p = (char*)chunk+sizeof(struct chunk_t);
+        if(chunk_of(p)==chunk && chunk->alloc==CHUNK_CACHED) free_chunk(chunk);
+        else if(LOG) printf("-Log- A queued pointer is not valid and can't be freed.\n");
+        chunk=next;
+    }
+}
+
+// Region functions
+struct heap_region_t *heap_region_create(size_t initial_size) {
+    // Takes one chunk for the region and its first block. initial_size 0 means REGION_SIZE_DEFAULT.
+    if(initial_size==0) initial_size=REGION_SIZE_DEFAULT;
+    if(initial_size>SIZE_MAX-sizeof(struct heap_region_t)-sizeof(struct region_block_t)) return NULL;
+    char *data = malloc_internal(sizeof(struct heap_region_t)+sizeof(struct region_block_t)+initial_size,0,NULL);
+    if(data==NULL) return NULL;
+    struct heap_region_t *region = (struct heap_region_t *)data;
+    memset(region,0,sizeof(struct heap_region_t));
+    region_block_init(region,(struct region_block_t *)(data+sizeof(struct heap_region_t)),initial_size);
+
+    pthread_mutex_lock(&regions_mtx);
+    region->next=regions;
+    if(regions) regions->prev=region;
+    regions=region;
+    pthread_mutex_unlock(&regions_mtx);
+    return region;
+}
+
+void *heap_region_alloc(struct heap_region_t *region, size_t size) {
+    // Bumps the top of the current block, chaining a new block to the region when it's full.
+    if(region==NULL || size==0) return NULL;
+    char *p = (char*)(((uintptr_t)region->top+REGION_ALIGNMENT-1)&~(uintptr_t)(REGION_ALIGNMENT-1));
+    if(p>region->end || size>(size_t)(region->end-p)) {
+        if(region_grow(region,size)!=0) return NULL;
+        p=(char*)(((uintptr_t)region->top+REGION_ALIGNMENT-1)&~(uintptr_t)(REGION_ALIGNMENT-1));
+    }
+    region->allocated+=p+size-region->top;
+    region->top=p+size;
+    return p;
+}
+
+void heap_region_destroy(struct heap_region_t *region) {
+    // Frees every block with a single heap_free(), whatever the number of allocations it holds.
+    if(region==NULL) return;
+    pthread_mutex_lock(&regions_mtx);
+    if(region->prev) region->prev->next=region->next;
+    else regions=region->next;
+    if(region->next) region->next->prev=region->prev;
+    pthread_mutex_unlock(&regions_mtx);
+
+    struct region_block_t *block = region->blocks;
+    while(block->prev) {
+        struct region_block_t *prev = block->prev;
+        free_internal(block);
+        block=prev;
+    }
+    free_internal(region); // the first block shares its chunk
+}
+
+static void region_block_init(struct heap_region_t *region, struct region_block_t *block, size_t size) {
+    if(INTEGRITY_FENCES) block->fence=REGIONFENCE;
+    block->size=size;
+    block->prev=region->blocks;
+    region->blocks=block;
+    region->top=(char*)block+sizeof(struct region_block_t);
+    region->end=region->top+size;
+    region->block_count++;
+}
+
+static int region_grow(struct heap_region_t *region, size_t size) {
+    // Chains a block with room for size bytes after alignment. What's left of the current block stays unused.
+    if(size>SIZE_MAX/2-sizeof(struct region_block_t)-REGION_ALIGNMENT) return -1;
+    size_t block_size=region->blocks->size*2;
+    if(block_size>REGION_BLOCK_MAX) block_size=REGION_BLOCK_MAX;
+    if(block_size<size+REGION_ALIGNMENT-1) block_size=size+REGION_ALIGNMENT-1;
+    struct region_block_t *block = malloc_internal(sizeof(struct region_block_t)+block_size,0,NULL);
+    if(block==NULL) return -1;
+    region_block_init(region,block,block_size);
+    return 0;
+}
+
+static enum validation_code_t region_validate(void) {
+    // Every block has to be a live heap block big enough for it, with the top of the region in the current one.
+    enum validation_code_t ret = no_errors;
+    pthread_mutex_lock(&regions_mtx);
+    for(struct heap_region_t *region=regions, *prev=NULL; region && ret==no_errors; prev=region, region=region->next) {
+        int blocks=0;
+        if(region->prev!=prev) ret=err_region;
+        for(struct region_block_t *block=region->blocks; block && ret==no_errors; block=block->prev) {
+            char *data = block->prev ? (char*)block : (char*)region;
+            if(get_pointer_type(data)!=pointer_valid || heap_get_block_size(data)<(size_t)((char*)block-data)+sizeof(struct region_block_t)+block->size) ret=err_region;
+            else if(INTEGRITY_FENCES && block->fence!=REGIONFENCE) ret=err_region;
+            blocks++;
+        }
+        if(ret!=no_errors) break;
+        char *start = (char*)region->blocks+sizeof(struct region_block_t);
+        if(blocks!=region->block_count || region->end!=start+region->blocks->size || region->top<start || region->top>region->end) ret=err_region;
+    }
+    pthread_mutex_unlock(&regions_mtx);
+    return ret;
+}
+
+// Pool functions
+struct heap_pool_t *heap_pool_create(size_t object_size, size_t objects_per_block) {
+    // Blocks are taken from the heap when the first object is allocated. objects_per_block 0 means POOL_OBJECTS_DEFAULT.
+    if(object_size==0 || object_size>SIZE_MAX-sizeof(void*)) return NULL;
+    if(objects_per_block==0) objects_per_block=POOL_OBJECTS_DEFAULT;
+    object_size=(object_size+sizeof(void*)-1)/sizeof(void*)*sizeof(void*);
+    if(objects_per_block>(SIZE_MAX-sizeof(struct pool_block_t))/object_size) return NULL;
+    struct heap_pool_t *pool = malloc_internal(sizeof(struct heap_pool_t),0,NULL);
+    if(pool==NULL) return NULL;
+    memset(pool,0,sizeof(struct heap_pool_t));
+    pool->object_size=object_size;
+    pool->objects_per_block=objects_per_block;
+
+    pthread_mutex_lock(&pools_mtx);
+    pool->next=pools;
+    if(pools) pools->prev=pool;
+    pools=pool;
+    pthread_mutex_unlock(&pools_mtx);
+    return pool;
+}
+
+void *heap_pool_alloc(struct heap_pool_t *pool) {
+    // Pops the free list, or carves the next object of the newest block.
+    if(pool==NULL) return NULL;
+    void *object = pool->free_list;
+    if(object!=NULL) pool->free_list=*(void**)object;
+    else {
+        if(pool->carve==pool->carve_end && pool_grow(pool)!=0) return NULL;
+        object=pool->carve;
+        pool->carve+=pool->object_size;
+    }
+    pool->objects_used++;
+    return object;
+}
+
+void heap_pool_free(struct heap_pool_t *pool, void *object) {
+    // Pushes the object on the free list. It has to come from heap_pool_alloc() of the same pool.
+    if(pool==NULL || object==NULL) return;
+    *(void**)object=pool->free_list;
+    pool->free_list=object;
+    pool->objects_used--;
+}
+
+void heap_pool_destroy(struct heap_pool_t *pool) {
+    // Frees the blocks, with any objects still in use.
+    if(pool==NULL) return;
+    pthread_mutex_lock(&pools_mtx);
+    if(pool->prev) pool->prev->next=pool->next;
+    else pools=pool->next;
+    if(pool->next) pool->next->prev=pool->prev;
+    pthread_mutex_unlock(&pools_mtx);
+
+    while(pool->blocks) {
+        struct pool_block_t *next = pool->blocks->next;
+        free_internal(pool->blocks);
+        pool->blocks=next;
+    }
+    free_internal(pool);
+}
+
+static int pool_grow(struct heap_pool_t *pool) {
+    struct pool_block_t *block = malloc_internal(sizeof(struct pool_block_t)+pool->object_size*pool->objects_per_block,0,NULL);
+    if(block==NULL) return -1;
+    if(INTEGRITY_FENCES) block->fence=POOLFENCE;
+    block->next=pool->blocks;
+    pool->blocks=block;
+    pool->block_count++;
+    pool->carve=(char*)block+sizeof(struct pool_block_t);
+    pool->carve_end=pool->carve+pool->object_size*pool->objects_per_block;
+    return 0;
+}
+
+static enum validation_code_t pool_validate(void) {
+    // Blocks have to be live heap blocks, and free objects have to lie on object boundaries of the blocks,
+    // adding up with the used and never given out ones to the capacity of the pool.
+    enum validation_code_t ret = no_errors;
+    pthread_mutex_lock(&pools_mtx);
+    for(struct heap_pool_t *pool=pools, *prev=NULL; pool && ret==no_errors; prev=pool, pool=pool->next) {
+        size_t block_size=pool->object_size*pool->objects_per_block;
+        int blocks=0;
+        if(pool->prev!=prev) ret=err_pool;
+        for(struct pool_block_t *block=pool->blocks; block && ret==no_errors; block=block->next) {
+            if(get_pointer_type(block)!=pointer_valid || heap_get_block_size(block)<sizeof(struct pool_block_t)+block_size) ret=err_pool;
+            else if(INTEGRITY_FENCES && block->fence!=POOLFENCE) ret=err_pool;
+            blocks++;
+        }
+        if(ret!=no_errors) break;
+        if(blocks!=pool->block_count) ret=err_pool;
+        else if(pool->blocks==NULL) {
+            if(pool->carve!=pool->carve_end || pool->free_list || pool->objects_used) ret=err_pool;
+            continue;
+        }
+        char *start = (char*)pool->blocks+sizeof(struct pool_block_t);
+        if(pool->carve_end!=start+block_size || pool->carve<start || pool->carve>pool->carve_end
+            || (pool->carve-start)%pool->object_size) ret=err_pool;
+
+        uint64_t capacity=(uint64_t)pool->block_count*pool->objects_per_block, free_objects=0;
+        for(void *object=pool->free_list; object && ret==no_errors; object=*(void**)object) {
+            struct pool_block_t *block = pool->blocks;
+            while(block && ((char*)object<(char*)block+sizeof(struct pool_block_t) || (char*)object>=(char*)block+sizeof(struct pool_block_t)+block_size)) block=block->next;
+            if(block==NULL || ((char*)object-(char*)block-sizeof(struct pool_block_t))%pool->object_size) ret=err_pool;
+            else if(++free_objects>capacity) ret=err_pool; // a loop
+        }
+        if(ret==no_errors && pool->objects_used+free_objects+(pool->carve_end-pool->carve)/pool->object_size!=capacity) ret=err_pool;
+    }
+    pthread_mutex_unlock(&pools_mtx);
+    return ret;
+}
+
+// Trace functions
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void trace_flush(struct trace_buffer_t *buffer) {
+    // Called with trace_mtx locked.
+    if(buffer->count && trace_file) fwrite(buffer->records,sizeof(struct trace_record_t),buffer->count,trace_file);
+    buffer->count=0;
+}
+
+static void trace_destructor(void *arg) {
+    // Writes the records of an exiting thread and unregisters its buffer.
+    struct trace_buffer_t *buffer = arg;
+    pthread_mutex_lock(&trace_mtx);
+    if(buffer->generation==trace_generation) {
+        trace_flush(buffer);
+        for(struct trace_buffer_t **link=&trace_buffers; *link; link=&(*link)->next) {
+            if(*link==buffer) {
+                *link=buffer->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&trace_mtx);
+    free(buffer);
+}
+
+static void trace_make_key(void) {
+    pthread_key_create(&trace_key,trace_destructor);
+}
+
+static void trace_record(enum trace_op_t op, uint64_t time, size_t size, const void *id, const void *old_id) {
+    // Records go to the buffer of the calling thread, which takes trace_mtx only when the buffer is full.
+    struct trace_buffer_t *buffer = trace_buffer;
+    if(buffer==NULL) {
+        buffer=calloc(1,sizeof(struct trace_buffer_t));
+        if(buffer==NULL) return;
+        pthread_once(&trace_key_once,trace_make_key);
+        pthread_setspecific(trace_key,buffer);
+        trace_buffer=buffer;
+    }
+    if(buffer->generation!=__atomic_load_n(&trace_generation,__ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&trace_mtx);
+        if(!trace_active) {
+            pthread_mutex_unlock(&trace_mtx);
+            return;
+        }
+        buffer->count=0;
+        buffer->thread=trace_next_thread++;
+        buffer->generation=trace_generation;
+        buffer->next=trace_buffers;
+        trace_buffers=buffer;
+        pthread_mutex_unlock(&trace_mtx);
+    }
+    struct trace_record_t *record = &buffer->records[buffer->count++];
+    record->time=time-trace_start_time;
+    record->id=(uintptr_t)id;
+    record->old_id=(uintptr_t)old_id;
+    record->size=size;
+    record->thread=buffer->thread;
+    record->op=op;
+    if(buffer->count==TRACE_BUFFER_RECORDS) {
+        pthread_mutex_lock(&trace_mtx);
+        trace_flush(buffer);
+        pthread_mutex_unlock(&trace_mtx);
+    }
+}
+
+int heap_trace_start(const char *path) {
+    // Starts recording the allocations and frees of all threads to a file. Returns 0, 1 if a trace is already
+    // being recorded and -1 if the file can't be written.
+    pthread_mutex_lock(&trace_mtx);
+    if(trace_active) {
+        pthread_mutex_unlock(&trace_mtx);
+        return 1;
+    }
+    trace_file=fopen(path,"wb");
+    struct trace_header_t header = {TRACE_MAGIC,TRACE_VERSION,sizeof(struct trace_record_t)};
+    if(trace_file==NULL || fwrite(&header,sizeof(header),1,trace_file)!=1) {
+        if(trace_file) fclose(trace_file);
+        trace_file=NULL;
+        pthread_mutex_unlock(&trace_mtx);
+        if(LOG) printf("-Log- Trace file can't be written.\n");
+        return -1;
+    }
+    trace_start_time=now_ns();
+    trace_next_thread=0;
+    trace_buffers=NULL;
+    __atomic_store_n(&trace_generation,trace_generation+1,__ATOMIC_RELEASE);
+    __atomic_store_n(&trace_active,1,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_mtx);
+    return 0;
+}
+
+int heap_trace_stop(void) {
+    // Writes the buffers of all threads and closes the trace. Other threads shouldn't allocate meanwhile,
+    // as their buffers are written without them knowing. Returns 0, or 1 if no trace is being recorded.
+    pthread_mutex_lock(&trace_mtx);
+    if(!trace_active) {
+        pthread_mutex_unlock(&trace_mtx);
+        return 1;
+    }
+    __atomic_store_n(&trace_active,0,__ATOMIC_RELEASE);
+    for(struct trace_buffer_t *buffer=trace_buffers; buffer; buffer=buffer->next) trace_flush(buffer);
+    trace_buffers=NULL;
+    __atomic_store_n(&trace_generation,trace_generation+1,__ATOMIC_RELEASE); // buffers register again for the next trace
+    fclose(trace_file);
+    trace_file=NULL;
+    pthread_mutex_unlock(&trace_mtx);
+    return 0;
+}
+
+// Instrumentation functions
+#if ALLOCOMORA_INSTRUMENT
+static void instrument_destructor(void *arg) {
+    // Keeps the counts of an exiting thread.
+    struct instrument_counters_t *counters = arg;
+    pthread_mutex_lock(&instrument_mtx);
+    if(counters->generation==instrument_generation) instrument_add(&instrument_retired,&counters->counters);
+    for(struct instrument_counters_t **link=&instrument_threads; *link; link=&(*link)->next) {
+        if(*link==counters) {
+            *link=counters->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&instrument_mtx);
+    free(counters);
+}
+
+static void instrument_make_key(void) {
+    pthread_key_create(&instrument_key,instrument_destructor);
+}
+
+static struct instrument_counters_t *instrument_current(void) {
+    // Counters of the calling thread, zeroed first if heap_reset_instrument() was called since they were used.
+    struct instrument_counters_t *counters = instrument_thread;
+    if(counters==NULL) {
+        counters=calloc(1,sizeof(struct instrument_counters_t));
+        if(counters==NULL) return &instrument_discard;
+        pthread_once(&instrument_key_once,instrument_make_key);
+        pthread_setspecific(instrument_key,counters);
+        pthread_mutex_lock(&instrument_mtx);
+        counters->generation=instrument_generation;
+        counters->next=instrument_threads;
+        instrument_threads=counters;
+        pthread_mutex_unlock(&instrument_mtx);
+        instrument_thread=counters;
+    }
+    unsigned int generation=__atomic_load_n(&instrument_generation,__ATOMIC_ACQUIRE);
+    if(counters->generation!=generation) {
+        memset(&counters->counters,0,sizeof(counters->counters));
+        __atomic_store_n(&counters->generation,generation,__ATOMIC_RELEASE);
+    }
+    return counters;
+}
+
+static void instrument_count(uint64_t *counter, uint64_t n) {
+    // Only the owning thread writes its counters, heap_get_instrument() may read them meanwhile.
+    __atomic_store_n(counter,__atomic_load_n(counter,__ATOMIC_RELAXED)+n,__ATOMIC_RELAXED);
+}
+
+static void instrument_time(enum timed_op_t op, uint64_t start) {
+    uint64_t duration=now_ns()-start;
+    int bucket = duration ? 63-__builtin_clzll(duration) : 0;
+    struct heap_instrument_t *counters = &instrument_current()->counters;
+    instrument_count(&counters->calls[op],1);
+    instrument_count(&counters->total_ns[op],duration);
+    instrument_count(&counters->latency[op][bucket<LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS-1],1);
+}
+#endif
+
+static void instrument_add(struct heap_instrument_t *sum, const struct heap_instrument_t *counters) {
+    // The structure is made of uint64_t counters only.
+    uint64_t *to = (uint64_t*)sum;
+    const uint64_t *from = (const uint64_t*)counters;
+    for(size_t i=0; i<sizeof(struct heap_instrument_t)/sizeof(uint64_t); i++) to[i]+=__atomic_load_n(&from[i],__ATOMIC_RELAXED);
+}
+
+void heap_get_instrument(struct heap_instrument_t *instrument) {
+    // Sums the counters of exited threads and of the running ones since the last heap_reset_instrument().
+    pthread_mutex_lock(&instrument_mtx);
+    *instrument=instrument_retired;
+    for(struct instrument_counters_t *counters=instrument_threads; counters; counters=counters->next) {
+        if(__atomic_load_n(&counters->generation,__ATOMIC_ACQUIRE)==instrument_generation) instrument_add(instrument,&counters->counters);
+    }
+    pthread_mutex_unlock(&instrument_mtx);
+}
+
+void heap_reset_instrument(void) {
+    // Threads zero their own counters when they see the new generation, so they're never written by two threads.
+    pthread_mutex_lock(&instrument_mtx);
+    memset(&instrument_retired,0,sizeof(instrument_retired));
+    __atomic_store_n(&instrument_generation,instrument_generation+1,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&instrument_mtx);
+}
+
+// Debug site functions
+static size_t debug_site_slot(const struct chunk_t *chunk) {
+    // Fibonacci hashing of the address. Collisions are resolved by linear probing.
+    return (size_t)(((uint64_t)(uintptr_t)chunk*0x9E3779B97F4A7C15ULL)>>(64-__builtin_ctzll(debug_sites_capacity)));
+}
+
+static int debug_sites_grow(void) {
+    // Rehashes the entries into a table twice as big. Called with debug_sites_mtx held.
+    size_t capacity=debug_sites_capacity*2;
+    struct debug_site_t *sites = calloc(capacity,sizeof(struct debug_site_t));
+    if(sites==NULL) return -1;
+    struct debug_site_t *old = debug_sites;
+    size_t old_capacity=debug_sites_capacity;
+    debug_sites=sites;
+    debug_sites_capacity=capacity;
+    for(size_t i=0; i<old_capacity; i++) {
+        if(old[i].chunk==NULL) continue;
+        size_t slot=debug_site_slot(old[i].chunk);
+        while(sites[slot].chunk!=NULL) slot=(slot+1)%capacity;
+        sites[slot]=old[i];
+    }
+    if(old!=debug_sites_initial) free(old);
+    return 0;
+}
+
+static void debug_site_set(struct chunk_t *chunk, int fileline, const char *filename) {
+    // Records the site of a newly allocated chunk. Chunks allocated without debug info get no entry,
+    // and no chunk does in integrity profile 0.
+    chunk->debug=0;
+    if(!INTEGRITY_FENCES || (fileline==0 && filename==NULL)) return;
+    pthread_mutex_lock(&debug_sites_mtx);
+    if(debug_sites_count<debug_sites_capacity/4*3 || debug_sites_grow()==0) {
+        size_t slot=debug_site_slot(chunk);
+        while(debug_sites[slot].chunk!=NULL) slot=(slot+1)%debug_sites_capacity;
+        debug_sites[slot].chunk=chunk;
+        debug_sites[slot].file=filename;
+        debug_sites[slot].line=fileline;
+        debug_sites_count++;
+        chunk->debug=1;
+    }
+    else if(LOG) printf("-Log- Debug site table can't grow, the site isn't recorded.\n");
+    pthread_mutex_unlock(&debug_sites_mtx);
+}
+
+static void debug_site_remove(struct chunk_t *chunk) {
+    pthread_mutex_lock(&debug_sites_mtx);
+    struct debug_site_t *site = debug_site_find(chunk);
+    if(site!=NULL) {
+        // Moves the following entries of the probe sequence back, so that lookups never need tombstones.
+        size_t hole=site-debug_sites;
+        for(size_t next=(hole+1)%debug_sites_capacity; debug_sites[next].chunk!=NULL; next=(next+1)%debug_sites_capacity) {
+            size_t home=debug_site_slot(debug_sites[next].chunk);
+            if((next>hole && (home<=hole || home>next)) || (next<hole && home<=hole && home>next)) {
+                debug_sites[hole]=debug_sites[next];
+                hole=next;
+            }
+        }
+        debug_sites[hole].chunk=NULL;
+        debug_sites_count--;
+    }
+    pthread_mutex_unlock(&debug_sites_mtx);
+    chunk->debug=0;
+}
+
+static struct debug_site_t *debug_site_find(const struct chunk_t *chunk) {
+    // Called with debug_sites_mtx held.
+    for(size_t slot=debug_site_slot(chunk); debug_sites[slot].chunk!=NULL; slot=(slot+1)%debug_sites_capacity) {
+        if(debug_sites[slot].chunk==chunk) return &debug_sites[slot];
+    }
+    return NULL;
+}
+
+// Free chunk index functions
+static void freelist_mapping(size_t size, int *fli, int *sli) {
+    if(size<SMALL_BLOCK_SIZE) {
+        *fli=0;
+        *sli=size/(SMALL_BLOCK_SIZE/SL_INDEX_COUNT);
+        return;
+    }
+    int fl=63-__builtin_clzll(size);
+    if(fl>=FL_INDEX_MAX) {
+        *fli=FL_INDEX_COUNT-1;
+        *sli=SL_INDEX_COUNT-1;
+        return;
+    }
+    *sli=(size>>(fl-SL_INDEX_LOG2))^SL_INDEX_COUNT;
+    *fli=fl-(FL_INDEX_SHIFT-1);
+}
+
+static struct chunk_t *freelist_search(struct free_index_t *free_index, int *fli, int *sli) {
+    // Finds the first non-empty bin starting from (fli, sli), using the bitmaps instead of walking the bins.
+    uint32_t sl_map=free_index->sl_bitmap[*fli]&(~0U<<*sli);
+    if(!sl_map) {
+        uint64_t fl_map=free_index->fl_bitmap&(~0ULL<<(*fli+1));
+        if(!fl_map) return NULL;
+        *fli=__builtin_ctzll(fl_map);
+        sl_map=free_index->sl_bitmap[*fli];
+    }
+    *sli=__builtin_ctz(sl_map);
+    return free_index->blocks[*fli][*sli];
+}
+
+static struct free_links_t *freelist_links(struct chunk_t *chunk) {
+    return (struct free_links_t *)((char*)chunk+sizeof(struct chunk_t));
+}
+
+void freelist_insert(struct chunk_t *chunk) {
+    struct free_index_t *free_index = &arena_of(chunk)->free_index;
+    free_index->free_bytes+=chunk->size;
+    free_index->free_chunks++;
+    free_index->sizes[size_bucket(chunk->size)]++;
+    if(chunk->size>=FREE_GAP_MIN_SIZE) free_index->free_gaps++;
+    if(chunk->size>free_index->largest) {
+        free_index->largest=chunk->size;
+        free_index->largest_count=1;
+    }
+    else if(chunk->size==free_index->largest) free_index->largest_count++;
+    if(chunk->size<FREELIST_MIN_SIZE) {
+        free_index->small_chunks[chunk->size]++;
+        return;
+    }
+    int fli, sli;
+    freelist_mapping(chunk->size,&fli,&sli);
+    struct free_links_t *links = freelist_links(chunk);
+    links->prev_free=NULL;
+    links->next_free=free_index->blocks[fli][sli];
+    if(links->next_free) freelist_links(links->next_free)->prev_free=chunk;
+    free_index->blocks[fli][sli]=chunk;
+    free_index->fl_bitmap|=1ULL<<fli;
+    free_index->sl_bitmap[fli]|=1U<<sli;
+    free_index->count++;
+}
+
+void freelist_remove(struct chunk_t *chunk) {
+    struct free_index_t *free_index = &arena_of(chunk)->free_index;
+    free_index->free_bytes-=chunk->size;
+    free_index->free_chunks--;
+    free_index->sizes[size_bucket(chunk->size)]--;
+    if(chunk->size>=FREE_GAP_MIN_SIZE) free_index->free_gaps--;
+    if(chunk->size==free_index->largest) free_index->largest_count--;
+    if(chunk->size<FREELIST_MIN_SIZE) {
+        free_index->small_chunks[chunk->size]--;
+        return;
+    }
+    int fli, sli;
+    freelist_mapping(chunk->size,&fli,&sli);
+    struct free_links_t *links = freelist_links(chunk);
+    if(links->next_free) freelist_links(links->next_free)->prev_free=links->prev_free;
+    if(links->prev_free) freelist_links(links->prev_free)->next_free=links->next_free;
+    else {
+        free_index->blocks[fli][sli]=links->next_free;
+        if(free_index->blocks[fli][sli]==NULL) {
+            free_index->sl_bitmap[fli]&=~(1U<<sli);
+            if(!free_index->sl_bitmap[fli]) free_index->fl_bitmap&=~(1ULL<<fli);
+        }
+    }
+    free_index->count--;
+}
+
+// Page map functions
+static size_t pagemap_page(const void *pointer) {
+    return ((char*)pointer-region_start)/PAGE_SIZE;
+}
+
+static size_t pagemap_prev_page(size_t page) {
+    // Returns the last non-empty page before the given one. The first page of an arena always holds its head chunk,
+    // so the search never leaves the arena. Summary words are shared by arenas, hence the atomic accesses.
+    size_t word=page/64;
+    uint64_t bits=page_map.bits[word]&((1ULL<<(page%64))-1);
+    if(bits) return word*64+63-__builtin_clzll(bits);
+    size_t sword=word/64;
+    uint64_t summary=__atomic_load_n(&page_map.summary[sword],__ATOMIC_RELAXED)&((1ULL<<(word%64))-1);
+    while(!summary) summary=__atomic_load_n(&page_map.summary[--sword],__ATOMIC_RELAXED);
+    word=sword*64+63-__builtin_clzll(summary);
+    return word*64+63-__builtin_clzll(page_map.bits[word]);
+}
+
+void pagemap_add(struct chunk_t *chunk) {
+    size_t page=pagemap_page(chunk);
+    if(page_map.last_chunk[page]!=NULL && page_map.last_chunk[page]>chunk) return;
+    page_map.last_chunk[page]=chunk;
+    page_map.bits[page/64]|=1ULL<<(page%64);
+    __atomic_fetch_or(&page_map.summary[page/4096],1ULL<<((page/64)%64),__ATOMIC_RELAXED);
+}
+
+void pagemap_remove(struct chunk_t *chunk) {
+    // Has to be called while chunk->prev is still valid.
+    size_t page=pagemap_page(chunk);
+    if(page_map.last_chunk[page]!=chunk) return;
+    if(chunk->prev!=NULL && pagemap_page(chunk->prev)==page) {
+        page_map.last_chunk[page]=chunk->prev;
+        return;
+    }
+    page_map.last_chunk[page]=NULL;
+    page_map.bits[page/64]&=~(1ULL<<(page%64));
+    if(!page_map.bits[page/64]) __atomic_fetch_and(&page_map.summary[page/4096],~(1ULL<<((page/64)%64)),__ATOMIC_RELAXED);
+}
+
+struct chunk_t *pagemap_find(const void *pointer) {
+    // Returns the chunk whose control block or data block contains the pointer.
+    if((char*)pointer<region_start) return NULL;
+    size_t page=pagemap_page(pointer);
+    if(page>=PAGEMAP_PAGES) return NULL;
+    struct chunk_t *chunk=page_map.last_chunk[page];
+    if(chunk==NULL) return page_map.last_chunk[pagemap_prev_page(page)];
+    while(chunk!=NULL && (char*)chunk>(char*)pointer) chunk=chunk->prev;
+    return chunk;
+}
+
+// Heap control functions
+enum pointer_type_t get_pointer_type(const void* pointer) {
+    if(pointer==NULL) return pointer_null;
+    char *p = (char*)pointer; // to perform pointer arithmetic
+    if(large_candidate(p)) return large_pointer_type(p);
+    struct heap_t *heap = &arena_of(p)->heap;
+    if(p<(char*)heap->data || p>=(char*)heap->end_fence_p+sizeof(int)) return pointer_out_of_heap;
+    if(p>=(char*)heap->end_fence_p) return pointer_end_fence;
+    struct chunk_t *i=pagemap_find(p);
+    if(i==NULL || p>=(char*)i+sizeof(struct chunk_t)+i->size) return pointer_out_of_heap;
+    if(p<(char*)i+sizeof(struct chunk_t)) return pointer_control_block;
+    if(i->alloc==0 || i->alloc==CHUNK_QUICK || i->alloc==CHUNK_CACHED) return pointer_unallocated;
+    if(i->alloc==CHUNK_SLAB) return slab_pointer_type(slab_of(i),p);
+    if(p==(char*)i+sizeof(struct chunk_t)) return pointer_valid;
+    return pointer_inside_data_block;
+}
+
+void update_heap_data() {
+    // split(), merge() and heap growth keep tail_chunk and chunks up to date,
+    // this walks the whole list of the main heap to recompute them (e.g. after fixing the heap by hand).
+    struct heap_t *heap = &arenas[0].heap;
+    struct chunk_t *ch = heap->head_chunk;
+    int chunks = 1;
+    while(ch->next!=NULL) {
+        ch=ch->next;
+        chunks++;
+    }
+    heap->tail_chunk=ch;
+    heap->chunks=chunks;
+
+    update_heap_checksum();
+}
+
+void update_end_fence() {
+    pthread_mutex_lock(&arenas[0].mtx);
+    arena_update_end_fence(&arenas[0]);
+    arena_unlock(&arenas[0]);
+}
+
+static void arena_update_end_fence(struct arena_t *arena) {
+    struct heap_t *heap = &arena->heap;
+    int end_fence=LASFENCE;
+    int *end_fence_e=(int*)((char*)heap->tail_chunk+sizeof(struct chunk_t)+heap->tail_chunk->size);
+    if(TESTING) printf("-Testing- update_end_fence() before memcpy\n");
+    if(INTEGRITY_FENCES) memcpy(end_fence_e,&end_fence,sizeof(int));
+    heap->end_fence_p=end_fence_e;
+    ARENA_CHECKSUM_UPDATE(arena);
+}
+
+// Statistics functions
+void* heap_get_data_block_start(const void* pointer) {
+    enum pointer_type_t type = get_pointer_type(pointer);
+    if(type==pointer_valid) return (void*)pointer;
+    if(type!=pointer_inside_data_block) return NULL;
+
+    struct chunk_t *tmp = chunk_of(pointer);
+    if(tmp->alloc==CHUNK_SLAB) {
+        struct slab_t *slab = slab_of(tmp);
+        return slab->objects+((char*)pointer-slab->objects)/slab->object_size*slab->object_size;
+    }
+    return (void*)((char*)tmp+sizeof(struct chunk_t));
+}
+
+size_t heap_get_used_space(void) {
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    return stats.used_space;
+}
+size_t heap_get_largest_used_block_size(void) {
+    size_t max=0;
+    for(int i=0; i<arena_count; i++) {
+        pthread_mutex_lock(&arenas[i].mtx);
+        struct chunk_t *tmp = arenas[i].heap.head_chunk;
+        while(tmp) {
+            if((tmp->alloc==1 || tmp->alloc==CHUNK_CACHED) && tmp->size>max) max=tmp->size;
+            else if(tmp->alloc==CHUNK_SLAB && slab_of(tmp)->used && slab_of(tmp)->object_size>max) max=slab_of(tmp)->object_size;
+            tmp=tmp->next;
+        }
+        arena_unlock(&arenas[i]);
+    }
+    pthread_mutex_lock(&large_mtx);
+    for(struct chunk_t *tmp=large_head; tmp; tmp=tmp->next) {
+        if(tmp->size>max) max=tmp->size;
+    }
+    pthread_mutex_unlock(&large_mtx);
+    return max;
+}
+
+uint64_t heap_get_used_blocks_count(void) {
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    return stats.used_blocks_count;
+}
+
+size_t heap_get_free_space(void) {
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    return stats.free_space;
+}
+
+size_t heap_get_largest_free_area(void) {
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    return stats.largest_free_area;
+}
+
+uint64_t heap_get_free_gaps_count(void) {
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    return stats.free_gaps_count;
+}
+
+size_t heap_get_block_size(const void* memblock) {
+    if (get_pointer_type(memblock)!=pointer_valid) return 0;
+    struct chunk_t *tmp = chunk_of(memblock);
+    if(tmp->alloc==CHUNK_SLAB) return slab_of(tmp)->object_size;
+    return tmp->size;
+}
+
+void heap_get_stats(struct heap_stats_t *stats) {
+    // Lock-free read of the snapshots last published by the arenas, each retried if a writer was publishing meanwhile.
+    memset(stats,0,sizeof(*stats));
+    for(int i=0; i<arena_count; i++) {
+        struct arena_t *arena = &arenas[i];
+        struct heap_stats_t snapshot;
+        unsigned int seq1, seq2;
+        do {
+            seq1=__atomic_load_n(&arena->stats_seq,__ATOMIC_ACQUIRE);
+            snapshot.used_space=__atomic_load_n(&arena->stats.used_space,__ATOMIC_RELAXED);
+            snapshot.free_space=__atomic_load_n(&arena->stats.free_space,__ATOMIC_RELAXED);
+            snapshot.largest_free_area=__atomic_load_n(&arena->stats.largest_free_area,__ATOMIC_RELAXED);
+            snapshot.used_blocks_count=__atomic_load_n(&arena->stats.used_blocks_count,__ATOMIC_RELAXED);
+            snapshot.free_gaps_count=__atomic_load_n(&arena->stats.free_gaps_count,__ATOMIC_RELAXED);
+            snapshot.pages=__atomic_load_n(&arena->stats.pages,__ATOMIC_RELAXED);
+            snapshot.chunks=__atomic_load_n(&arena->stats.chunks,__ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            seq2=__atomic_load_n(&arena->stats_seq,__ATOMIC_RELAXED);
+        } while((seq1&1) || seq1!=seq2);
+        stats->used_space+=snapshot.used_space;
+        stats->free_space+=snapshot.free_space;
+        if(snapshot.largest_free_area>stats->largest_free_area) stats->largest_free_area=snapshot.largest_free_area;
+        stats->used_blocks_count+=snapshot.used_blocks_count;
+        stats->free_gaps_count+=snapshot.free_gaps_count;
+        stats->pages+=snapshot.pages;
+        stats->chunks+=snapshot.chunks;
+    }
+    // Large blocks are used space only, whole pages each.
+    int large_blocks=__atomic_load_n(&large_count,__ATOMIC_RELAXED);
+    size_t large_size=__atomic_load_n(&large_pages,__ATOMIC_RELAXED);
+    stats->used_space+=large_size*PAGE_SIZE;
+    stats->used_blocks_count+=large_blocks;
+    stats->pages+=large_size;
+    stats->chunks+=large_blocks;
+}
+
+void heap_get_realloc_stats(struct heap_realloc_stats_t *stats) {
+    stats->in_place_shrink=__atomic_load_n(&realloc_stats.in_place_shrink,__ATOMIC_RELAXED);
+    stats->in_place_next=__atomic_load_n(&realloc_stats.in_place_next,__ATOMIC_RELAXED);
+    stats->in_place_tail=__atomic_load_n(&realloc_stats.in_place_tail,__ATOMIC_RELAXED);
+    stats->moved_prev=__atomic_load_n(&realloc_stats.moved_prev,__ATOMIC_RELAXED);
+    stats->remapped=__atomic_load_n(&realloc_stats.remapped,__ATOMIC_RELAXED);
+    stats->copied=__atomic_load_n(&realloc_stats.copied,__ATOMIC_RELAXED);
+}
+
+void heap_get_fragmentation_report(struct heap_fragmentation_report_t *report) {
+    // Copies the histograms the arenas keep, locking each of them briefly. Only the large blocks are walked,
+    // there are few of them.
+    memset(report,0,sizeof(*report));
+    if(!arenas[0].heap.is_set) return;
+    for(int i=0; i<arena_count; i++) {
+        struct arena_t *arena = &arenas[i];
+        pthread_mutex_lock(&arena->mtx);
+        for(int b=0; b<SIZE_BUCKETS; b++) {
+            report->free_blocks[b]+=arena->free_index.sizes[b];
+            report->used_blocks[b]+=arena->used_sizes[b];
+        }
+        report->header_overhead+=(size_t)arena->heap.chunks*sizeof(struct chunk_t)+(size_t)arena->slab_count*sizeof(struct slab_t);
+        report->wasted_tails+=__atomic_load_n(&arena->wasted_tails,__ATOMIC_RELAXED);
+        report->wasted_tail_bytes+=__atomic_load_n(&arena->wasted_tail_bytes,__ATOMIC_RELAXED);
+        arena_unlock(arena);
+    }
+    pthread_mutex_lock(&large_mtx);
+    for(struct chunk_t *chunk=large_head; chunk; chunk=chunk->next) {
+        report->used_blocks[size_bucket(chunk->size)]++;
+        report->header_overhead+=sizeof(struct chunk_t);
+    }
+    pthread_mutex_unlock(&large_mtx);
+
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    if(stats.free_space) report->external_fragmentation=1.0-(double)stats.largest_free_area/stats.free_space;
+}
+
+static void stats_publish(struct arena_t *arena) {
+    // Called with the arena locked (or before other threads can use it), so there is a single writer.
+    struct free_index_t *free_index = &arena->free_index;
+    if(free_index->largest_count==0) {
+        // The last chunk of the largest size has left the index, so the top bin is walked once to find the new one.
+        size_t largest=0;
+        uint64_t largest_count=0;
+        if(free_index->fl_bitmap) {
+            int fli=63-__builtin_clzll(free_index->fl_bitmap);
+            int sli=31-__builtin_clz(free_index->sl_bitmap[fli]);
+            for(struct chunk_t *p=free_index->blocks[fli][sli]; p; p=freelist_links(p)->next_free) {
+                if(p->size>largest) {
+                    largest=p->size;
+                    largest_count=0;
+                }
+                if(p->size==largest) largest_count++;
+            }
+        }
+        else {
+            for(int i=FREELIST_MIN_SIZE-1; i>=0 && largest_count==0; i--) {
+                if(free_index->small_chunks[i]) {
+                    largest=i;
+                    largest_count=free_index->small_chunks[i];
+                }
+            }
+        }
+        free_index->largest=largest;
+        free_index->largest_count=largest_count;
+    }
+    size_t largest=free_index->largest;
+    size_t heap_size=(size_t)arena->heap.pages*PAGE_SIZE;
+    // Free objects of slabs and parked chunks count as free space, a slab chunk as one used block per allocated object.
+    size_t free_space=free_index->free_bytes+arena->slab_free_bytes+arena->quick_bytes;
+    uint64_t used_blocks=arena->heap.chunks-free_index->free_chunks-arena->slab_count+arena->slab_objects-arena->quick_chunks;
+
+    unsigned int seq=arena->stats_seq;
+    __atomic_store_n(&arena->stats_seq,seq+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&arena->stats.used_space,heap_size-free_space,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats.free_space,free_space,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats.largest_free_area,largest,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats.used_blocks_count,used_blocks,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats.free_gaps_count,free_index->free_gaps,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats.pages,arena->heap.pages,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats.chunks,arena->heap.chunks,__ATOMIC_RELAXED);
+    __atomic_store_n(&arena->stats_seq,seq+2,__ATOMIC_RELEASE);
+}
+
+void heap_get_pool_stats(const struct heap_pool_t *pool, struct heap_pool_stats_t *stats) {
+    // Occupancy of a pool, or the totals of all live pools if pool is NULL.
+    memset(stats,0,sizeof(*stats));
+    if(pool!=NULL) {
+        pool_stats_add(pool,stats);
+        return;
+    }
+    pthread_mutex_lock(&pools_mtx);
+    for(struct heap_pool_t *p=pools; p; p=p->next) pool_stats_add(p,stats);
+    pthread_mutex_unlock(&pools_mtx);
+}
+
+static void pool_stats_add(const struct heap_pool_t *pool, struct heap_pool_stats_t *stats) {
+    uint64_t capacity=(uint64_t)pool->block_count*pool->objects_per_block;
+    stats->pools++;
+    stats->blocks+=pool->block_count;
+    stats->objects_used+=pool->objects_used;
+    stats->objects_free+=capacity-pool->objects_used;
+    stats->used_space+=pool->objects_used*pool->object_size;
+    stats->block_space+=(size_t)pool->block_count*(sizeof(struct pool_block_t)+pool->object_size*pool->objects_per_block);
 }
 
 // Checksum functions
-void update_chunk_checksum(struct chunk_t *chunk) {
-    chunk->checksum=1;
-    int newsum=0;
-    for(int i=0; i<sizeof(struct chunk_t); i++) {
-        newsum+=*(((char*)chunk)+i);
+static void checksum_init(void) {
+    // Builds the table of the software CRC32C and switches to the SSE4.2 instruction if the CPU has it.
+    for(uint32_t i=0; i<256; i++) {
+        uint32_t crc=i;
+        for(int k=0; k<8; k++) crc=(crc>>1)^(0x82F63B78&-(crc&1));
+        crc32c_table[i]=crc;
     }
-    chunk->checksum=newsum;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) checksum_kernel=crc32c_hw;
+#endif
 }
 
-void update_heap_checksum() {
-    heap.checksum=1;
-    int newsum=0;
-    struct heap_t *p = &heap;
-    for(int i=0; i<sizeof(struct heap_t); i++) {
-        newsum+=*(((char*)p)+i);
+static uint32_t crc32c_sw(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint32_t crc=~0U;
+    while(size--) crc=(crc>>8)^crc32c_table[(crc^*p++)&0xFF];
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const void *data, size_t size) {
+    // Same result as crc32c_sw(), 8 bytes per instruction. Control blocks aren't aligned, so words are loaded with memcpy.
+    const char *p = data;
+    uint64_t crc=~0U;
+    for(; size>=8; size-=8, p+=8) {
+        uint64_t word;
+        memcpy(&word,p,sizeof(word));
+        crc=_mm_crc32_u64(crc,word);
     }
-    heap.checksum=newsum;
+    for(; size; size--, p++) crc=_mm_crc32_u8((uint32_t)crc,*p);
+    return ~(uint32_t)crc;
+}
+#endif
+
+void update_chunk_checksum(struct chunk_t *chunk) {
+    // A chunk goes in and out of thread caches without its arena lock, so a cached chunk has the checksum
+    // of an allocated one.
+    INSTRUMENT_COUNT(checksum_updates,1);
+    struct chunk_t header;
+    memcpy(&header,chunk,sizeof(struct chunk_t));
+    if(header.alloc==CHUNK_CACHED) header.alloc=1;
+    header.checksum=1;
+    chunk->checksum=(int)checksum_kernel(&header,sizeof(struct chunk_t));
+}
+
+void update_heap_checksum() {
+    update_arena_checksum(&arenas[0]);
+}
+
+static void update_arena_checksum(struct arena_t *arena) {
+    struct heap_t *p = &arena->heap;
+    INSTRUMENT_COUNT(checksum_updates,1);
+    p->checksum=1;
+    p->checksum=(int)checksum_kernel(p,sizeof(struct heap_t));
 }
 
 int verify_chunk_checksum(struct chunk_t *chunk) {
@@ -629,60 +2794,132 @@ int verify_chunk_checksum(struct chunk_t *chunk) {
 }
 
 int verify_heap_checksum() {
-    int oldsum=heap.checksum;
-    update_heap_checksum();
-    int newsum=heap.checksum;
-    heap.checksum=oldsum;
+    return verify_arena_checksum(&arenas[0]);
+}
+
+static int verify_arena_checksum(struct arena_t *arena) {
+    int oldsum=arena->heap.checksum;
+    update_arena_checksum(arena);
+    int newsum=arena->heap.checksum;
+    arena->heap.checksum=oldsum;
     if(oldsum!=newsum) return 1;
     return 0;
 }
 
 // Calculation functions
-size_t calc_dist(struct chunk_t *chunk) {
-    struct chunk_t *p = heap.head_chunk;
-    size_t dist=0;
-    while(p!=chunk) {
-        dist+=sizeof(struct chunk_t)+p->size;
-        if(p->next) p=p->next;
-        else return 0;
-    }
-    dist+=sizeof(struct chunk_t);
-    return dist;
-}
-
-size_t calc_size_in_page(struct chunk_t *chunk, size_t dist) {
-    int page=dist/PAGE_SIZE+1;
-    size_t size = PAGE_SIZE-(dist%PAGE_SIZE);
-    if(page==heap.pages) size-=4;
-    if(chunk->size<size) return chunk->size;
-    return size;
+size_t calc_aligned_offset(const struct chunk_t *chunk, size_t alignment) {
+    // Distance from the data block of a chunk to the first aligned address that can start a data block of its own:
+    // either the data block itself or one leaving room for the control block of the slack before it.
+    uintptr_t data=(uintptr_t)chunk+sizeof(struct chunk_t);
+    if((data&(alignment-1))==0) return 0;
+    return ((data+sizeof(struct chunk_t)+alignment-1)&~(uintptr_t)(alignment-1))-data;
 }
 
-int is_aligned(size_t dist) {
-    return !!(dist%PAGE_SIZE);
-}
-
-
 // Validation functions
 enum validation_code_t heap_validate() {
-    if(verify_heap_checksum()) return err_heap_checksum;
-    if(heap.head_chunk==NULL) return err_head_is_null;
-    if(heap.tail_chunk==NULL) return err_tail_is_null;
-    if((char*)heap.head_chunk!=(char*)heap.data) return err_invalid_head;
-    if(*(heap.end_fence_p)!=LASFENCE) return err_end_fence;
+    for(int i=0; i<arena_count; i++) {
+        enum validation_code_t ret = arena_validate(&arenas[i]);
+        if(ret!=no_errors) return ret;
+    }
+    enum validation_code_t ret = large_validate();
+    if(ret!=no_errors) return ret;
+    ret=region_validate();
+    if(ret!=no_errors) return ret;
+    return pool_validate();
+}
+
+static enum validation_code_t arena_validate(struct arena_t *arena) {
+    struct heap_t *heap = &arena->heap;
+    struct free_index_t *free_index = &arena->free_index;
+    if(INTEGRITY_CHECKSUMS && verify_arena_checksum(arena)) return err_heap_checksum;
+    if(heap->head_chunk==NULL) return err_head_is_null;
+    if(heap->tail_chunk==NULL) return err_tail_is_null;
+    if((char*)heap->head_chunk!=(char*)heap->data) return err_invalid_head;
+    if(INTEGRITY_FENCES && *(heap->end_fence_p)!=LASFENCE) return err_end_fence;
 
-    struct chunk_t *p = heap.head_chunk;
+    struct chunk_t *p = heap->head_chunk;
     struct chunk_t *prev = NULL;
+    size_t free_chunks=0;
+    size_t pages_with_chunks=0;
+    int slabs=0, parked=0;
+    uint64_t slab_objects=0;
+    uint64_t free_sizes[SIZE_BUCKETS]={0}, used_sizes[SIZE_BUCKETS]={0};
     while(p) {
-        if(p->first_fence!=FIRFENCE) return err_chunk_fence1;
-        if(p->second_fence!=SECFENCE) return err_chunk_fence2;
-        if(verify_chunk_checksum(p)) return err_chunk_checksum;
+        if(INTEGRITY_FENCES && p->first_fence!=FIRFENCE) return err_chunk_fence1;
+        if(INTEGRITY_FENCES && p->second_fence!=SECFENCE) return err_chunk_fence2;
+        if(INTEGRITY_CHECKSUMS && verify_chunk_checksum(p)) return err_chunk_checksum;
         if(p->next && p->next!=(struct chunk_t *)((char*)p+sizeof(struct chunk_t)+p->size)) return err_invalid_next;
         if(p->prev!=prev) return err_invalid_prev;
+        if(p->alloc==0 && p->size>=FREELIST_MIN_SIZE) free_chunks++;
+        if(p->alloc==0) free_sizes[size_bucket(p->size)]++;
+        else if(p->alloc==1 || p->alloc==CHUNK_CACHED) used_sizes[size_bucket(p->size)]++;
+        else if(p->alloc==CHUNK_QUICK) parked++;
+        if(p->debug) {
+            pthread_mutex_lock(&debug_sites_mtx);
+            struct debug_site_t *site = debug_site_find(p);
+            pthread_mutex_unlock(&debug_sites_mtx);
+            if(p->debug!=1 || p->alloc!=1 || site==NULL) return err_debug_site;
+        }
+        if(p->alloc==CHUNK_SLAB) {
+            struct slab_t *slab = slab_of(p);
+            if(p->size!=SLAB_SIZE || (INTEGRITY_FENCES && slab->fence!=SLABFENCE) || slab->size_class<0 || slab->size_class>=SLAB_CLASSES) return err_slab;
+            int free_objects=0;
+            for(int i=0; i<SLAB_MAP_WORDS; i++) free_objects+=__builtin_popcountll(slab->free_map[i]);
+            if(free_objects!=slab->capacity-slab->used) return err_slab;
+            slabs++;
+            slab_objects+=slab->used;
+            used_sizes[size_bucket(slab->object_size)]+=slab->used;
+        }
+        if(p->next==NULL || pagemap_page(p->next)!=pagemap_page(p)) {
+            if(page_map.last_chunk[pagemap_page(p)]!=p) return err_page_map;
+            pages_with_chunks++;
+        }
         prev=p;
         p=p->next;
     }
-    if(heap.tail_chunk!=prev) return err_invalid_tail;
+    if(heap->tail_chunk!=prev) return err_invalid_tail;
+    // Only the main heap grows, so it owns every page map word after its start.
+    size_t first_word=pagemap_page(heap->data)/64;
+    size_t last_word=arena==&arenas[0] ? PAGEMAP_WORDS : first_word+heap_config.arena_pages/64;
+    size_t pages_in_map=0;
+    for(size_t i=first_word; i<last_word; i++) pages_in_map+=__builtin_popcountll(page_map.bits[i]);
+    if(pages_in_map!=pages_with_chunks) return err_page_map;
+
+    // Every chunk in the free chunk index has to be free and placed in its bin.
+    size_t indexed=0;
+    for(int fli=0; fli<FL_INDEX_COUNT; fli++) {
+        for(int sli=0; sli<SL_INDEX_COUNT; sli++) {
+            for(p=free_index->blocks[fli][sli]; p; p=freelist_links(p)->next_free) {
+                int chunk_fli, chunk_sli;
+                freelist_mapping(p->size,&chunk_fli,&chunk_sli);
+                if(p->alloc || chunk_fli!=fli || chunk_sli!=sli) return err_free_index;
+                if(++indexed>free_chunks) return err_free_index;
+            }
+        }
+    }
+    if(indexed!=free_chunks || free_index->count!=free_chunks) return err_free_index;
+    if(slabs!=arena->slab_count || slab_objects!=arena->slab_objects) return err_slab;
+
+    // Every parked chunk has to be on the quick list of its size class.
+    int listed=0;
+    size_t parked_bytes=0;
+    for(int i=0; i<QUICK_CLASSES; i++) {
+        int count=0;
+        for(p=arena->quick[i]; p; p=*tcache_link(p)) {
+            if(p->alloc!=CHUNK_QUICK || (int)((p->size-1)/QUICK_CLASS_SIZE)!=i || arena_of(p)!=arena) return err_quick_list;
+            if(++listed>parked) return err_quick_list;
+            parked_bytes+=p->size;
+            count++;
+        }
+        if(count!=arena->quick_counts[i]) return err_quick_list;
+    }
+    if(listed!=parked || arena->quick_chunks!=parked || arena->quick_bytes!=parked_bytes) return err_quick_list;
+    if(memcmp(free_sizes,free_index->sizes,sizeof(free_sizes)) || memcmp(used_sizes,arena->used_sizes,sizeof(used_sizes))) return err_size_histogram;
+    for(int i=0; i<SLAB_CLASSES; i++) {
+        for(struct slab_t *slab=arena->slabs[i], *prev=NULL; slab; prev=slab, slab=slab->next) {
+            if(slab->prev!=prev || slab->size_class!=i || slab->used==slab->capacity) return err_slab;
+        }
+    }
     return no_errors;
 }
 
@@ -700,25 +2937,50 @@ enum validation_code_t validate_and_print() {
     else if(ret==9) printf("[Heap validation] Invalid next\n");
     else if(ret==10) printf("[Heap validation] Invalid head\n");
     else if(ret==11) printf("[Heap validation] Invalid tail\n");
+    else if(ret==12) printf("[Heap validation] Free chunk index error\n");
+    else if(ret==13) printf("[Heap validation] Page map error\n");
+    else if(ret==14) printf("[Heap validation] Slab error\n");
+    else if(ret==15) printf("[Heap validation] Debug site error\n");
+    else if(ret==16) printf("[Heap validation] Large block error\n");
+    else if(ret==17) printf("[Heap validation] Size histogram error\n");
+    else if(ret==18) printf("[Heap validation] Region error\n");
+    else if(ret==19) printf("[Heap validation] Pool error\n");
+    else if(ret==20) printf("[Heap validation] Quick list error\n");
     return ret;
 }
 
 // Debug dump functions
 void heap_dump_debug_information() {
     printf("\n***  HEAP INFO  ***\n");
-    struct chunk_t *p = heap.head_chunk;
     int cnt=0;
     
-    while(p) {
-        printf("* Chunk %d:\n",++cnt);
-        printf("- Chunk address: %p\n",p);
-        printf("- Allocated: %d\n",p->alloc);
-        printf("- Chunk size: %lu (incl. metadata: %lu)\n",p->size,p->size+sizeof(struct chunk_t));
-        if(p->debug_line!=0)printf("- Debug fileline: %d\n",p->debug_line);
-        if(p->debug_file!=NULL)printf("- Debug filename: %s\n",p->debug_file);
+    for(int i=0; i<arena_count; i++) {
+        if(arena_count>1) printf("* Arena %d:\n\n",i);
+        struct chunk_t *p = arenas[i].heap.head_chunk;
+        while(p) {
+            printf("* Chunk %d:\n",++cnt);
+            printf("- Chunk address: %p\n",p);
+            printf("- Allocated: %d\n",p->alloc);
+            printf("- Chunk size: %lu (incl. metadata: %lu)\n",p->size,p->size+sizeof(struct chunk_t));
+            if(p->alloc==CHUNK_SLAB) printf("- Slab: %d of %d objects (%d B) used\n",slab_of(p)->used,slab_of(p)->capacity,slab_of(p)->object_size);
+            const char *debug_file;
+            int debug_line;
+            if(heap_get_debug_site((char*)p+sizeof(struct chunk_t),&debug_file,&debug_line)) {
+                if(debug_line!=0)printf("- Debug fileline: %d\n",debug_line);
+                if(debug_file!=NULL)printf("- Debug filename: %s\n",debug_file);
+            }
+            printf("\n");
+            p=p->next;
+        }
+    }
+    pthread_mutex_lock(&large_mtx);
+    for(struct chunk_t *p=large_head; p; p=p->next) {
+        printf("* Large block %d:\n",++cnt);
+        printf("- Block address: %p\n",p);
+        printf("- Block size: %lu (pages: %lu)\n",p->size,large_map_size(p->size)/PAGE_SIZE);
         printf("\n");
-        p=p->next;
     }
+    pthread_mutex_unlock(&large_mtx);
 
     printf("* Heap data:\n");
     printf("- Heap size: %lu\n",heap_get_used_space()+heap_get_free_space());
@@ -729,6 +2991,20 @@ void heap_dump_debug_information() {
     printf("\n*******************\n"); 
 }
 
+int heap_get_debug_site(const void *memblock, const char **filename, int *fileline) {
+    // Gives the site of a block allocated by a heap_*_debug() function. Returns 0 if the block has none.
+    struct chunk_t *chunk = heap_get_control_block(memblock);
+    if(chunk==NULL || !chunk->debug) return 0;
+    pthread_mutex_lock(&debug_sites_mtx);
+    struct debug_site_t *site = debug_site_find(chunk);
+    if(site!=NULL) {
+        if(filename) *filename=site->file;
+        if(fileline) *fileline=site->line;
+    }
+    pthread_mutex_unlock(&debug_sites_mtx);
+    return site!=NULL;
+}
+
 void print_pointer_type(const void* pointer) {
     enum pointer_type_t type = get_pointer_type(pointer);
     if(type==pointer_null) printf("[%p] is null\n", pointer);
@@ -742,11 +3018,21 @@ void print_pointer_type(const void* pointer) {
 
 // Extra functions
 struct chunk_t *heap_get_control_block(const void *pointer) {
+    // Slab objects have no control block of their own.
     if(pointer==NULL) return NULL;
     if(get_pointer_type(pointer)!=pointer_valid) return NULL;
+    if(chunk_of(pointer)->alloc==CHUNK_SLAB) return NULL;
     return (struct chunk_t *)(pointer-sizeof(struct chunk_t));
 }
 
 struct heap_t *get_heap() {
-    return &heap;
+    return &arenas[0].heap;
+}
+
+int heap_get_arena(const void *pointer) {
+    // Index of the arena a pointer belongs to, -1 if it's outside of the heap (large blocks included).
+    char *p = (char*)pointer;
+    if(!arenas[0].heap.is_set || p<region_start) return -1;
+    if(p>=(char*)arenas[0].heap.data+(size_t)__atomic_load_n(&arenas[0].heap.pages,__ATOMIC_RELAXED)*PAGE_SIZE) return -1;
+    return arena_of(p)-arenas;
 }
\ No newline at end of file
@@ -9,24 +9,359 @@
 #define FIRFENCE 369258303
 #define SECFENCE 495105411
 #define LASFENCE 693452304
+#define SLABFENCE 529637018
+#define REGIONFENCE 742781329
+#define POOLFENCE 615243087
+#define CHUNK_SLAB 2 // value of chunk_t.alloc for chunks holding a slab
+#define CHUNK_LARGE 3 // value of chunk_t.alloc for blocks in the mmap region
+#define CHUNK_QUICK 4 // value of chunk_t.alloc for freed chunks parked on a quick list
+#define CHUNK_CACHED 5 // value of chunk_t.alloc for freed chunks in a thread cache or a remote free queue, still allocated for the heap
+
+// Free chunk index (two-level segregated fit)
+#define SL_INDEX_LOG2 4
+#define SL_INDEX_COUNT (1<<SL_INDEX_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_LOG2+3) // sizes below SMALL_BLOCK_SIZE share first level 0
+#define FL_INDEX_MAX 40 // sizes from 2^FL_INDEX_MAX up share the last bin
+#define FL_INDEX_COUNT (FL_INDEX_MAX-FL_INDEX_SHIFT+1)
+#define SMALL_BLOCK_SIZE (1<<FL_INDEX_SHIFT)
+#define FREELIST_MIN_SIZE sizeof(struct free_links_t) // smaller free chunks are not indexed
+#define FREELIST_SCAN_LIMIT 8 // max chunks inspected per bin when looking for the best fit
+#define FREE_GAP_MIN_SIZE (sizeof(void*)+sizeof(struct chunk_t)) // smaller free chunks aren't counted as gaps
+
+// Page map (address to chunk index)
+#define PAGEMAP_PAGES (16*KB) // max. heap size in pages, 64 MB
+#define PAGEMAP_WORDS (PAGEMAP_PAGES/64)
+#define PAGEMAP_SUMMARY_WORDS ((PAGEMAP_WORDS+63)/64)
+
+// Aligned allocation
+#define ALIGNMENT_MIN 16
+#define ALIGNMENT_MAX (2*MB)
+
+// Thread caches
+#define TCACHE_COUNT_DEFAULT 0 // chunks cached per size class and thread, 0 disables thread caches
+#define TCACHE_MAX_SIZE 1024 // bigger chunks are never cached
+#define TCACHE_CLASS_SIZE 16
+#define TCACHE_CLASSES (TCACHE_MAX_SIZE/TCACHE_CLASS_SIZE)
+
+// Quick lists (deferred coalescing)
+#define QUICK_COUNT_DEFAULT 0 // chunks parked per size class and arena, 0 disables quick lists
+#define QUICK_MAX_SIZE 512 // bigger chunks are merged when they're freed
+#define QUICK_CLASS_SIZE 16
+#define QUICK_CLASSES (QUICK_MAX_SIZE/QUICK_CLASS_SIZE)
+
+// Arenas
+#define ARENA_COUNT_DEFAULT 1
+#define ARENA_MAX 16
+#define ARENA_PAGES_DEFAULT 256 // size of every arena but the main one, has to be a multiple of 64 pages
+
+// Slabs (small objects)
+#define SLAB_MAX_SIZE_DEFAULT 0 // biggest request served from slabs, 0 disables slabs
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASS_SIZE 16 // also the alignment of slab objects
+#define SLAB_CLASSES (SLAB_MAX_SIZE/SLAB_CLASS_SIZE)
+#define SLAB_SIZE (PAGE_SIZE-sizeof(struct chunk_t)) // a slab and its control block take one page
+#define SLAB_MAP_WORDS 4 // enough for SLAB_SIZE/SLAB_CLASS_SIZE objects
+
+// Trimming the main heap
+#define TRIM_THRESHOLD_DEFAULT 32 // free pages at the end of the heap which make heap_free() give pages back
+#define TRIM_DISABLED -1
+
+// Large blocks (mmap region)
+#define LARGE_THRESHOLD_DEFAULT 0 // smallest request served from the mmap region, 0 keeps every block in the heap
+#define LARGE_THRESHOLD_MIN PAGE_SIZE // smaller blocks would waste most of their page, slab chunks stay in the heap
+
+// Regions (bump allocation)
+#define REGION_SIZE_DEFAULT (16*KB) // first block of heap_region_create(0)
+#define REGION_BLOCK_MAX MB // blocks double in size up to it, bigger allocations get a block of their own size
+#define REGION_ALIGNMENT 16
+
+// Pools (fixed-size objects)
+#define POOL_OBJECTS_DEFAULT 64 // objects per block of heap_pool_create(size, 0)
+
+// Fragmentation report
+#define SIZE_BUCKETS 48 // log2 buckets, bucket i holds sizes from 2^i to 2^(i+1)-1 (0 is in bucket 0)
+
+// Debug site table
+#define DEBUG_SITES_INITIAL (16*KB) // a power of 2, the table doubles when it's 3/4 full
+
+// Allocation traces
+#define TRACE_MAGIC 0x43525441 // "ATRC" at the start of a trace file
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_RECORDS 4096 // records buffered per thread before they're written
+
+// Instrumentation, compiled in with -DALLOCOMORA_INSTRUMENT=1. Every thread counts in its own
+// struct heap_instrument_t, heap_get_instrument() adds them up.
+#ifndef ALLOCOMORA_INSTRUMENT
+#define ALLOCOMORA_INSTRUMENT 0
+#endif
+#define LATENCY_BUCKETS 32 // log2 buckets of call durations in ns
+#if ALLOCOMORA_INSTRUMENT
+#define INSTRUMENT_START(start) uint64_t start=now_ns()
+#define INSTRUMENT_END(op,start) instrument_time(op,start)
+#define INSTRUMENT_COUNT(counter,n) instrument_count(&instrument_current()->counters.counter,n)
+#else
+#define INSTRUMENT_START(start)
+#define INSTRUMENT_END(op,start)
+#define INSTRUMENT_COUNT(counter,n)
+#endif
+
+// Integrity profiles, chosen with -DALLOCOMORA_INTEGRITY=n. heap_validate() checks only what the profile maintains.
+// 0: no fences, checksums or debug sites, only the structure of the heap is kept and checked
+// 1: fences of control blocks, slabs and heaps' ends, debug sites of heap_*_debug() calls
+// 2: also CRC32C checksums of control blocks and heaps (the default)
+#ifndef ALLOCOMORA_INTEGRITY
+#define ALLOCOMORA_INTEGRITY 2
+#endif
+#define INTEGRITY_FENCES (ALLOCOMORA_INTEGRITY>=1)
+#define INTEGRITY_CHECKSUMS (ALLOCOMORA_INTEGRITY>=2)
+#if INTEGRITY_FENCES
+#define FENCES_SET(chunk) ((chunk)->first_fence=FIRFENCE,(chunk)->second_fence=SECFENCE)
+#define FENCES_VALID(chunk) ((chunk)->first_fence==FIRFENCE && (chunk)->second_fence==SECFENCE)
+#else
+#define FENCES_SET(chunk) ((void)0)
+#define FENCES_VALID(chunk) 1
+#endif
+#if INTEGRITY_CHECKSUMS
+#define CHUNK_CHECKSUM_UPDATE(chunk) update_chunk_checksum(chunk)
+#define ARENA_CHECKSUM_UPDATE(arena) update_arena_checksum(arena)
+#else
+#define CHUNK_CHECKSUM_UPDATE(chunk) ((void)0)
+#define ARENA_CHECKSUM_UPDATE(arena) ((void)0)
+#endif
 
 // Debug options
 #define LOG 0
 #define TESTING 0
 
 // Structures
+// The fields used by every operation come first. Debug sites are kept in a separate table.
 struct chunk_t {
     int first_fence;
-    struct chunk_t *prev;
+    char alloc;
+    char debug; // 1 if the chunk has an entry in the debug site table
     size_t size;
     struct chunk_t *next;
-    int debug_line;
-    const char *debug_file;
-    char alloc;
+    struct chunk_t *prev;
     int checksum;
     int second_fence;
 };
 
+// File and line of a heap_*_debug() call, for an allocated chunk
+struct debug_site_t {
+    const struct chunk_t *chunk; // NULL for an empty entry
+    const char *file;
+    int line;
+};
+
+// Links of an indexed free chunk, stored in its (unused) data block
+struct free_links_t {
+    struct chunk_t *prev_free;
+    struct chunk_t *next_free;
+};
+
+struct free_index_t {
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[FL_INDEX_COUNT];
+    struct chunk_t *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    size_t count;
+    // Totals of all free chunks, including the ones too small to be indexed
+    size_t free_bytes;
+    uint64_t free_chunks;
+    uint64_t free_gaps;
+    uint64_t small_chunks[FREELIST_MIN_SIZE];
+    uint64_t sizes[SIZE_BUCKETS];
+    // Size of the largest free chunk and how many chunks have it. No chunk is bigger; once the count drops to 0
+    // the size is stale until stats_publish() recomputes it.
+    size_t largest;
+    uint64_t largest_count;
+};
+
+// Header of a slab, stored in the data block of a chunk. The objects of its size class follow it.
+struct slab_t {
+    int fence;
+    int size_class;
+    int object_size;
+    int capacity;
+    int used;
+    struct slab_t *prev; // list of the arena's slabs with free objects
+    struct slab_t *next;
+    char *objects;
+    uint64_t free_map[SLAB_MAP_WORDS]; // set bits mark free objects
+};
+
+// Recently freed chunks of a thread, grouped by size. They stay allocated for the heap.
+struct thread_cache_t {
+    struct chunk_t *bins[TCACHE_CLASSES];
+    int counts[TCACHE_CLASSES];
+    unsigned int generation; // heap_setup() call the cached chunks come from
+    char registered;
+};
+
+// Header of a region's block, stored in the data block of a chunk. The allocations follow it.
+struct region_block_t {
+    int fence;
+    size_t size; // bytes after the header
+    struct region_block_t *prev; // block filled before it, NULL for the first one
+};
+
+// Returned by heap_region_create(), stored before the header of its first block.
+// A region is used by one thread at a time, only the list of live regions is locked.
+struct heap_region_t {
+    struct region_block_t *blocks; // the current block
+    char *top; // next free byte of the current block
+    char *end;
+    size_t allocated; // bytes given out, including alignment padding
+    int block_count;
+    struct heap_region_t *prev; // list of live regions, walked by heap_validate()
+    struct heap_region_t *next;
+};
+
+// Header of a pool's block, stored in the data block of a chunk. The objects follow it.
+struct pool_block_t {
+    int fence;
+    struct pool_block_t *next;
+};
+
+// Returned by heap_pool_create(). A pool is used by one thread at a time, only the list of live pools is locked.
+struct heap_pool_t {
+    size_t object_size; // rounded up to a multiple of a pointer's size, free objects hold the free list's links
+    size_t objects_per_block;
+    void *free_list;
+    char *carve; // objects of the newest block never given out yet
+    char *carve_end;
+    struct pool_block_t *blocks; // newest first
+    int block_count;
+    uint64_t objects_used;
+    struct heap_pool_t *prev; // list of live pools, walked by heap_validate() and heap_get_pool_stats()
+    struct heap_pool_t *next;
+};
+
+// Operations of a trace, with the public functions they're recorded in
+enum trace_op_t {
+    trace_malloc, // heap_malloc(), heap_malloc_debug()
+    trace_calloc, // heap_calloc(), heap_calloc_debug(), size is number*size
+    trace_realloc, // heap_realloc(), heap_realloc_debug()
+    trace_free, // heap_free(), heap_free_sized(), heap_free_batch()
+};
+
+// Start of a trace file, followed by the records of all threads. Every thread's records are in order,
+// but the threads' buffers are interleaved, so a replay sorts them by time.
+struct trace_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// An operation of a trace. Blocks are identified by their address, ids are reused after a block is freed.
+struct trace_record_t {
+    uint64_t time; // ns since heap_trace_start()
+    uint64_t id; // block returned, or given to free, 0 if none
+    uint64_t old_id; // block given to realloc
+    uint64_t size;
+    uint32_t thread;
+    uint8_t op;
+} __attribute__((packed));
+
+// Records of a thread not written yet
+struct trace_buffer_t {
+    struct trace_record_t records[TRACE_BUFFER_RECORDS];
+    int count;
+    uint32_t thread;
+    unsigned int generation; // heap_trace_start() call the buffer is registered for
+    struct trace_buffer_t *next; // in the list of registered buffers
+};
+
+// Operations with latency histograms
+enum timed_op_t {
+    timed_malloc, // heap_malloc(), heap_malloc_debug(), heap_calloc()
+    timed_free, // heap_free(), heap_free_sized()
+    timed_realloc,
+    timed_malloc_aligned,
+    timed_split,
+    timed_merge,
+    timed_ops_count
+};
+
+// Returned by heap_get_instrument(), all zeros unless ALLOCOMORA_INSTRUMENT is set
+struct heap_instrument_t {
+    uint64_t calls[timed_ops_count];
+    uint64_t total_ns[timed_ops_count];
+    uint64_t latency[timed_ops_count][LATENCY_BUCKETS]; // calls by log2 of their duration in ns
+    uint64_t find_free_calls;
+    uint64_t find_free_inspected; // free chunks looked at by find_free_chunk()
+    uint64_t sbrk_calls;
+    uint64_t checksum_updates; // chunk and arena checksums computed, including the ones verified
+};
+
+// Counters of a thread
+struct instrument_counters_t {
+    struct heap_instrument_t counters;
+    unsigned int generation; // heap_reset_instrument() call the counters started after
+    struct instrument_counters_t *next; // in the list of threads' counters
+};
+
+// Options given to heap_setup_config(), zero arena and trim values mean the defaults
+struct heap_config_t {
+    int thread_cache_count;
+    int quick_list_count; // freed chunks parked per size class and arena, 0 disables quick lists
+    int arena_count;
+    int arena_pages;
+    int slab_max_size;
+    int trim_threshold; // in pages, TRIM_DISABLED turns trimming off
+    int large_threshold; // in bytes
+};
+
+// Snapshot returned by heap_get_stats()
+struct heap_stats_t {
+    size_t used_space;
+    size_t free_space;
+    size_t largest_free_area;
+    uint64_t used_blocks_count;
+    uint64_t free_gaps_count;
+    int pages;
+    int chunks;
+};
+
+// Returned by heap_get_fragmentation_report(), kept up to date by the allocator instead of walking the heap
+struct heap_fragmentation_report_t {
+    uint64_t free_blocks[SIZE_BUCKETS]; // free chunks by size
+    uint64_t used_blocks[SIZE_BUCKETS]; // allocated chunks, slab objects and large blocks by size
+    double external_fragmentation; // 1 - largest free area / free space, 0 without free space
+    size_t header_overhead; // bytes taken by control blocks and slab headers
+    uint64_t wasted_tails; // blocks left bigger than asked for, as the rest was too small to be split off (since heap_setup())
+    size_t wasted_tail_bytes;
+};
+
+// Occupancy of a pool, or of all of them, returned by heap_get_pool_stats()
+struct heap_pool_stats_t {
+    int pools;
+    int blocks;
+    uint64_t objects_used;
+    uint64_t objects_free; // including the ones never given out
+    size_t used_space; // bytes of used objects
+    size_t block_space; // bytes of the blocks, with their headers
+};
+
+// Counters of the ways heap_realloc() resized blocks, returned by heap_get_realloc_stats()
+struct heap_realloc_stats_t {
+    uint64_t in_place_shrink; // including blocks which were big enough already
+    uint64_t in_place_next; // merged with the free chunk after the block
+    uint64_t in_place_tail; // the main heap grew behind the block
+    uint64_t moved_prev; // merged with the free chunk before the block, the data moved with memmove()
+    uint64_t remapped; // large blocks
+    uint64_t copied; // malloc-copy-free
+};
+
+// For every heap page, the last control block starting in it (NULL if there is none).
+// Bitmaps of non-empty pages let a lookup find the previous non-empty page in constant time.
+// Pages of the mmap region, which lies above the heap in the same space, point to their large block instead.
+struct page_map_t {
+    struct chunk_t *last_chunk[PAGEMAP_PAGES];
+    struct chunk_t *large_block[PAGEMAP_PAGES];
+    uint64_t bits[PAGEMAP_WORDS];
+    uint64_t summary[PAGEMAP_SUMMARY_WORDS];
+};
+
 struct heap_t {
     struct chunk_t *head_chunk;
     struct chunk_t *tail_chunk;
@@ -38,6 +373,28 @@ struct heap_t {
     int checksum;
 };
 
+// A heap with its own chunk list, free chunk index and lock. Arena 0 is the main heap, which grows
+// with custom_sbrk(). The other arenas have fixed regions placed before it and fall back to it when full.
+struct arena_t {
+    struct heap_t heap;
+    struct free_index_t free_index;
+    struct heap_stats_t stats;
+    unsigned int stats_seq;
+    pthread_mutex_t mtx;
+    struct slab_t *slabs[SLAB_CLASSES];
+    int slab_count;
+    uint64_t slab_objects;
+    size_t slab_free_bytes;
+    struct chunk_t *remote_frees; // freed by threads which found the arena locked, drained by its lock holder
+    uint64_t used_sizes[SIZE_BUCKETS]; // allocated chunks and slab objects
+    uint64_t wasted_tails;
+    size_t wasted_tail_bytes;
+    struct chunk_t *quick[QUICK_CLASSES]; // freed chunks not merged yet, linked through their data
+    int quick_counts[QUICK_CLASSES];
+    int quick_chunks;
+    size_t quick_bytes;
+};
+
 // Enums
 enum pointer_type_t {
       pointer_null,
@@ -61,11 +418,21 @@ enum validation_code_t {
     err_invalid_prev,
     err_invalid_next,
     err_invalid_head,
-    err_invalid_tail
+    err_invalid_tail,
+    err_free_index,
+    err_page_map,
+    err_slab,
+    err_debug_site,
+    err_large_block,
+    err_size_histogram,
+    err_region,
+    err_pool,
+    err_quick_list
 };
 
 // Heap basic functions
 int heap_setup();
+int heap_setup_config(const struct heap_config_t *config);
 int heap_delete(int safe_mode);
 int heap_reset();
 
@@ -73,25 +440,53 @@ int heap_reset();
 void *heap_malloc_debug(size_t count, int fileline, const char* filename);
 void* heap_calloc_debug(size_t number, size_t size, int fileline, const char* filename); 
 void* heap_realloc_debug(void* memblock, size_t size, int fileline, const char* filename);
+size_t heap_malloc_batch(size_t count, size_t size, void **out);
 
 // *alloc_aligned functions
 void *heap_malloc_aligned_debug(size_t count, int fileline, const char *filename);
 void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename); 
 void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename);
+void *heap_malloc_aligned_ex_debug(size_t count, size_t alignment, int fileline, const char *filename);
 
 // Non-debug *alloc and *alloc_aligned functions
 void *heap_malloc(size_t count);
 void *heap_calloc(size_t number, size_t size);
 void *heap_realloc(void* memblock, size_t size);
 void *heap_malloc_aligned(size_t count);
+void *heap_malloc_aligned_ex(size_t count, size_t alignment);
 void *heap_calloc_aligned(size_t number, size_t size);
 void *heap_realloc_aligned(void* memblock, size_t size);
 
 // Chunk management functions
 void heap_free(void* memblock);
+void heap_free_sized(void *memblock, size_t size);
+void heap_free_batch(void **ptrs, size_t n);
 struct chunk_t *merge(struct chunk_t *chunk1, struct chunk_t *chunk2, char safe_mode);
 struct chunk_t *split(struct chunk_t *chunk_to_split, size_t size);
-void *find_free_chunk(size_t size);
+void *find_free_chunk(struct arena_t *arena, size_t size);
+
+// Thread cache functions
+void heap_thread_cache_flush(void);
+
+// Region functions
+struct heap_region_t *heap_region_create(size_t initial_size);
+void *heap_region_alloc(struct heap_region_t *region, size_t size);
+void heap_region_destroy(struct heap_region_t *region);
+
+// Pool functions
+struct heap_pool_t *heap_pool_create(size_t object_size, size_t objects_per_block);
+void *heap_pool_alloc(struct heap_pool_t *pool);
+void heap_pool_free(struct heap_pool_t *pool, void *object);
+void heap_pool_destroy(struct heap_pool_t *pool);
+
+// Free chunk index functions
+void freelist_insert(struct chunk_t *chunk);
+void freelist_remove(struct chunk_t *chunk);
+
+// Page map functions
+void pagemap_add(struct chunk_t *chunk);
+void pagemap_remove(struct chunk_t *chunk);
+struct chunk_t *pagemap_find(const void *pointer);
 
 // Heap control functions
 enum pointer_type_t get_pointer_type(const void* pointer);
@@ -107,6 +502,18 @@ size_t heap_get_free_space(void);
 size_t heap_get_largest_free_area(void);
 uint64_t heap_get_free_gaps_count(void);
 size_t heap_get_block_size(const void* memblock);
+void heap_get_stats(struct heap_stats_t *stats);
+void heap_get_realloc_stats(struct heap_realloc_stats_t *stats);
+void heap_get_fragmentation_report(struct heap_fragmentation_report_t *report);
+void heap_get_pool_stats(const struct heap_pool_t *pool, struct heap_pool_stats_t *stats);
+
+// Trace functions
+int heap_trace_start(const char *path);
+int heap_trace_stop(void);
+
+// Instrumentation functions
+void heap_get_instrument(struct heap_instrument_t *instrument);
+void heap_reset_instrument(void);
 
 // Checksum functions
 void update_chunk_checksum(struct chunk_t *chunk);
@@ -115,9 +522,7 @@ int verify_chunk_checksum(struct chunk_t *chunk);
 int verify_heap_checksum();
 
 // Calculation functions
-size_t calc_dist(struct chunk_t *chunk);
-size_t calc_size_in_page(struct chunk_t *chunk, size_t dist);
-int is_aligned(size_t dist);
+size_t calc_aligned_offset(const struct chunk_t *chunk, size_t alignment);
 
 // Validation functions
 enum validation_code_t heap_validate(void);
@@ -125,10 +530,12 @@ enum validation_code_t validate_and_print();
 
 // Debug dump functions
 void heap_dump_debug_information(void);
+int heap_get_debug_site(const void *memblock, const char **filename, int *fileline);
 void print_pointer_type(const void* pointer);
 
 // Extra functions
 struct chunk_t *heap_get_control_block(const void *pointer);
 struct heap_t *get_heap();
+int heap_get_arena(const void *pointer);
 
 #endif //ALLOCOMORA_H
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include "allocomora.h"
+#include "custom_unistd.h"
+
+// Results are printed as "benchmark,metric,value" lines. Allocation benchmarks are run against
+// the heap and against the C library's malloc as a baseline, metrics of the latter start with "glibc_".
+
+static volatile int sink;
+static uint64_t rng_state=0x9E3779B97F4A7C15ULL;
+
+struct allocator_t {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *memblock);
+    void *(*realloc)(void *memblock, size_t size);
+    void *(*calloc)(size_t number, size_t size);
+    void *(*aligned)(size_t size, size_t alignment);
+};
+
+void *libc_aligned(size_t size, size_t alignment) {
+    void *p;
+    return posix_memalign(&p,alignment,size)==0 ? p : NULL;
+}
+
+struct allocator_t allocators[] = {
+    {"allocomora",heap_malloc,heap_free,heap_realloc,heap_calloc,heap_malloc_aligned_ex},
+    {"glibc",malloc,free,realloc,calloc,libc_aligned},
+};
+
+enum size_dist_t { dist_fixed, dist_uniform, dist_power_law };
+const char *dist_names[] = {"fixed","uniform","power_law"};
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+uint64_t rng_next() {
+    // xorshift64*, so that both allocators see the same sequence of sizes
+    rng_state^=rng_state>>12;
+    rng_state^=rng_state<<25;
+    rng_state^=rng_state>>27;
+    return rng_state*0x2545F4914F6CDD1DULL;
+}
+
+size_t next_size(enum size_dist_t dist) {
+    switch(dist) {
+        case dist_fixed:
+            return 64;
+        case dist_uniform:
+            return 16+rng_next()%1009;
+        default: {
+            // Pareto with alpha 1.5: mostly small blocks and a long tail, capped at 64 KB.
+            double u=((rng_next()>>11)+1)*(1.0/9007199254740992.0);
+            double size=16.0/pow(u,1/1.5);
+            return size>64*KB ? 64*KB : (size_t)size;
+        }
+    }
+}
+
+int compare_double(const void *a, const void *b) {
+    double d1=*(const double*)a, d2=*(const double*)b;
+    return (d1>d2)-(d1<d2);
+}
+
+void print_result(const char *bench, const struct allocator_t *a, const char *metric, double value) {
+    if(a==&allocators[0]) printf("%s,%s,%.2f\n",bench,metric,value);
+    else printf("%s,%s_%s,%.2f\n",bench,a->name,metric,value);
+}
+
+// The checksum used before CRC32C: a sum of signed bytes.
+void byte_sum_checksum(struct chunk_t *chunk) {
+    chunk->checksum=1;
+    int newsum=0;
+    for(int i=0; i<sizeof(struct chunk_t); i++) {
+        newsum+=*(((char*)chunk)+i);
+    }
+    chunk->checksum=newsum;
+}
+
+void bench_checksum() {
+    int count=4096, rounds=1000;
+    char *headers = malloc(count*sizeof(struct chunk_t)+1);
+    memset(headers,0x5A,count*sizeof(struct chunk_t)+1);
+    struct chunk_t *chunks = (struct chunk_t *)(headers+1); // control blocks aren't aligned in the heap either
+
+    double start=now_ns();
+    for(int r=0; r<rounds; r++) {
+        for(int i=0; i<count; i++) byte_sum_checksum(&chunks[i]);
+    }
+    double byte_sum=(now_ns()-start)/((double)rounds*count);
+    sink=chunks[count-1].checksum;
+
+    start=now_ns();
+    for(int r=0; r<rounds; r++) {
+        for(int i=0; i<count; i++) update_chunk_checksum(&chunks[i]);
+    }
+    double crc=(now_ns()-start)/((double)rounds*count);
+    sink=chunks[count-1].checksum;
+
+    printf("chunk_checksum_byte_sum,ns_per_op,%.2f\n",byte_sum);
+    printf("chunk_checksum_crc32c,ns_per_op,%.2f\n",crc);
+    printf("chunk_checksum,speedup,%.2f\n",byte_sum/crc);
+    free(headers);
+}
+
+void bench_malloc_free(const struct allocator_t *a, enum size_dist_t dist) {
+    // Random frees and allocations over a window of live blocks, then single malloc()/free() pairs timed one by one.
+    int window=1000, ops=500000, samples=100000;
+    char bench[64];
+    void **live = calloc(window,sizeof(void*));
+    rng_state=0x9E3779B97F4A7C15ULL;
+    double start=now_ns();
+    for(int i=0; i<ops; i++) {
+        int slot=rng_next()%window;
+        if(live[slot]) a->free(live[slot]);
+        live[slot]=a->malloc(next_size(dist));
+    }
+    double elapsed=now_ns()-start;
+    snprintf(bench,sizeof(bench),"malloc_free_%s",dist_names[dist]);
+    print_result(bench,a,"ns_per_op",elapsed/ops);
+
+    double *lat = malloc(samples*sizeof(double));
+    for(int i=0; i<samples; i++) {
+        size_t size=next_size(dist);
+        double t=now_ns();
+        void *p = a->malloc(size);
+        a->free(p);
+        lat[i]=now_ns()-t;
+    }
+    qsort(lat,samples,sizeof(double),compare_double);
+    print_result(bench,a,"p50_ns",lat[samples/2]);
+    print_result(bench,a,"p99_ns",lat[samples*99/100]);
+    print_result(bench,a,"max_ns",lat[samples-1]);
+    free(lat);
+    for(int i=0; i<window; i++) a->free(live[i]);
+    free(live);
+}
+
+void bench_realloc(const struct allocator_t *a) {
+    // A block growing by small steps and by doubling. A small allocation after every step keeps
+    // the heap from simply having free space after the block.
+    int rounds=50, steps=1000;
+    void **pins = malloc(steps*sizeof(void*));
+    double start=now_ns();
+    for(int r=0; r<rounds; r++) {
+        void *p = a->malloc(16);
+        for(int i=1; i<=steps; i++) {
+            p=a->realloc(p,16+i*64);
+            pins[i-1]=(i%8==0) ? a->malloc(32) : NULL;
+        }
+        a->free(p);
+        for(int i=0; i<steps; i++) if(pins[i]) a->free(pins[i]);
+    }
+    print_result("realloc_linear",a,"ns_per_op",(now_ns()-start)/((double)rounds*steps));
+
+    int doublings=16;
+    start=now_ns();
+    for(int r=0; r<rounds; r++) {
+        void *p = a->malloc(16);
+        for(int i=1; i<=doublings; i++) {
+            p=a->realloc(p,(size_t)16<<i);
+            pins[i-1]=a->malloc(32);
+        }
+        a->free(p);
+        for(int i=0; i<doublings; i++) a->free(pins[i]);
+    }
+    print_result("realloc_doubling",a,"ns_per_op",(now_ns()-start)/((double)rounds*doublings));
+    free(pins);
+}
+
+void bench_calloc(const struct allocator_t *a) {
+    int ops=200000;
+    rng_state=0x9E3779B97F4A7C15ULL;
+    double start=now_ns();
+    for(int i=0; i<ops; i++) {
+        char *p = a->calloc(1+rng_next()%64,16);
+        sink=p[0];
+        a->free(p);
+    }
+    print_result("calloc_free",a,"ns_per_op",(now_ns()-start)/ops);
+}
+
+void bench_aligned(const struct allocator_t *a, size_t alignment) {
+    int window=256, ops=100000;
+    char bench[64];
+    void **live = calloc(window,sizeof(void*));
+    rng_state=0x9E3779B97F4A7C15ULL;
+    double start=now_ns();
+    for(int i=0; i<ops; i++) {
+        int slot=rng_next()%window;
+        if(live[slot]) a->free(live[slot]);
+        live[slot]=a->aligned(next_size(dist_uniform),alignment);
+    }
+    snprintf(bench,sizeof(bench),"aligned_%lu",alignment);
+    print_result(bench,a,"ns_per_op",(now_ns()-start)/ops);
+    for(int i=0; i<window; i++) a->free(live[i]);
+    free(live);
+}
+
+void bench_validate(int live_chunks) {
+    // Cost of heap_validate() and heap_get_stats() with the given number of allocated chunks.
+    char **p = malloc(live_chunks*sizeof(char*));
+    int count=0;
+    while(count<live_chunks && (p[count]=heap_malloc(16+count%48))!=NULL) count++;
+    if(count==live_chunks) {
+        int rounds=live_chunks>=100000 ? 5 : 20;
+        double start=now_ns();
+        for(int r=0; r<rounds; r++) sink=heap_validate();
+        printf("heap_validate_%d,us_per_op,%.2f\n",live_chunks,(now_ns()-start)/rounds/1e3);
+        struct heap_stats_t stats;
+        start=now_ns();
+        for(int r=0; r<rounds; r++) heap_get_stats(&stats);
+        sink=stats.chunks;
+        printf("heap_get_stats_%d,us_per_op,%.2f\n",live_chunks,(now_ns()-start)/rounds/1e3);
+    }
+    else fprintf(stderr,"%d chunks don't fit in the simulated heap, heap_validate_%d skipped\n",live_chunks,live_chunks);
+    for(int i=0; i<count; i++) heap_free(p[i]);
+    free(p);
+}
+
+int main() {
+    int status = heap_setup();
+    if(status!=0) return 1;
+    bench_checksum();
+    for(int i=0; i<2; i++) {
+        for(int dist=dist_fixed; dist<=dist_power_law; dist++) bench_malloc_free(&allocators[i],dist);
+        bench_realloc(&allocators[i]);
+        bench_calloc(&allocators[i]);
+        bench_aligned(&allocators[i],64);
+        bench_aligned(&allocators[i],PAGE_SIZE);
+    }
+    for(int live=1000; live<=1000000; live*=10) bench_validate(live);
+    heap_delete(0);
+    return 0;
+}
@@ -5,6 +5,9 @@
 #include <assert.h>
 
 void* custom_sbrk(intptr_t delta);
+void* custom_mmap(size_t size);
+int custom_munmap(void* addr, size_t size);
+void* custom_mremap(void* addr, size_t old_size, size_t new_size);
 
 #if defined(sbrk)
 #undef sbrk
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 
 #define PAGE_SIZE       4096    // Długość strony w bajtach
@@ -26,7 +27,9 @@ struct mm_struct {
     // Poniższe pola nie należą do standardowej struktury mm_struct
     struct memory_fence_t fence;
     intptr_t start_mmap;
-} mm;
+    uint8_t mmap_pages[PAGES_AVAILABLE]; // 1 dla stron zajętych przez custom_mmap()
+    pthread_mutex_t lock;
+} mm = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 void __attribute__((constructor)) memory_init(void)
 {
@@ -97,17 +100,143 @@ void __attribute__((destructor)) memory_check(void)
 
 void* custom_sbrk(intptr_t delta)
 {
+    pthread_mutex_lock(&mm.lock);
     intptr_t current_brk = mm.brk;
     if (mm.start_brk + delta < 0) {
         errno = 0;
+        pthread_mutex_unlock(&mm.lock);
         return (void*)current_brk;
     }
     
     if (mm.brk + delta >= mm.start_mmap) {
         errno = ENOMEM;
+        pthread_mutex_unlock(&mm.lock);
         return (void*)-1;
     }
     
     mm.brk += delta;
+    pthread_mutex_unlock(&mm.lock);
     return (void*)current_brk;
 }
+
+//
+// Obszar mmap rośnie w dół od końca przestrzeni, w stronę brk.
+// Strony są przydzielane od góry; gdy brakuje wolnego ciągu stron, obszar jest powiększany.
+//
+
+static size_t mmap_page(intptr_t addr)
+{
+    return (addr - mm.start_brk) / PAGE_SIZE;
+}
+
+static void* mmap_locked(size_t pages)
+{
+    size_t first = mmap_page(mm.start_mmap);
+    size_t run = 0;
+    for (size_t i = PAGES_AVAILABLE; i > first; i--) {
+        run = mm.mmap_pages[i - 1] ? 0 : run + 1;
+        if (run == pages) {
+            memset(mm.mmap_pages + i - 1, 1, pages);
+            return (void*)(mm.start_brk + (i - 1) * PAGE_SIZE);
+        }
+    }
+    
+    // Wolne strony na dole obszaru zostają wykorzystane, brakujące są dokładane poniżej.
+    size_t free_bottom = 0;
+    while (first + free_bottom < PAGES_AVAILABLE && !mm.mmap_pages[first + free_bottom] && free_bottom < pages)
+        free_bottom++;
+    size_t needed = pages - free_bottom;
+    if (needed > first || mm.start_mmap - (intptr_t)needed * PAGE_SIZE <= mm.brk) {
+        errno = ENOMEM;
+        return (void*)-1;
+    }
+    mm.start_mmap -= needed * PAGE_SIZE;
+    memset(mm.mmap_pages + first - needed, 1, pages);
+    return (void*)mm.start_mmap;
+}
+
+static void munmap_locked(intptr_t addr, size_t pages)
+{
+    memset(mm.mmap_pages + mmap_page(addr), 0, pages);
+    while (mm.start_mmap < mm.start_brk + PAGES_AVAILABLE * PAGE_SIZE && !mm.mmap_pages[mmap_page(mm.start_mmap)])
+        mm.start_mmap += PAGE_SIZE;
+}
+
+static int mmap_range_valid(intptr_t addr, size_t pages)
+{
+    if (addr < mm.start_mmap || (addr - mm.start_brk) % PAGE_SIZE || pages == 0)
+        return 0;
+    if (mmap_page(addr) + pages > PAGES_AVAILABLE)
+        return 0;
+    for (size_t i = 0; i < pages; i++)
+        if (!mm.mmap_pages[mmap_page(addr) + i])
+            return 0;
+    return 1;
+}
+
+void* custom_mmap(size_t size)
+{
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages == 0) {
+        errno = EINVAL;
+        return (void*)-1;
+    }
+    pthread_mutex_lock(&mm.lock);
+    void* result = mmap_locked(pages);
+    pthread_mutex_unlock(&mm.lock);
+    return result;
+}
+
+int custom_munmap(void* addr, size_t size)
+{
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    pthread_mutex_lock(&mm.lock);
+    if (!mmap_range_valid((intptr_t)addr, pages)) {
+        pthread_mutex_unlock(&mm.lock);
+        errno = EINVAL;
+        return -1;
+    }
+    munmap_locked((intptr_t)addr, pages);
+    pthread_mutex_unlock(&mm.lock);
+    return 0;
+}
+
+void* custom_mremap(void* addr, size_t old_size, size_t new_size)
+{
+    // Jak mremap() z MREMAP_MAYMOVE: zmniejszenie oddaje końcowe strony, powiększenie
+    // dokłada wolne strony tuż za blokiem, a gdy ich nie ma, przenosi blok w inne miejsce.
+    size_t old_pages = (old_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t new_pages = (new_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    intptr_t start = (intptr_t)addr;
+    pthread_mutex_lock(&mm.lock);
+    if (new_pages == 0 || !mmap_range_valid(start, old_pages)) {
+        pthread_mutex_unlock(&mm.lock);
+        errno = EINVAL;
+        return (void*)-1;
+    }
+    if (new_pages <= old_pages) {
+        if (new_pages < old_pages)
+            munmap_locked(start + new_pages * PAGE_SIZE, old_pages - new_pages);
+        pthread_mutex_unlock(&mm.lock);
+        return addr;
+    }
+    
+    size_t last = mmap_page(start) + old_pages;
+    size_t free_after = 0;
+    while (last + free_after < PAGES_AVAILABLE && !mm.mmap_pages[last + free_after] && free_after < new_pages - old_pages)
+        free_after++;
+    if (free_after == new_pages - old_pages) {
+        memset(mm.mmap_pages + last, 1, free_after);
+        pthread_mutex_unlock(&mm.lock);
+        return addr;
+    }
+    
+    // Symulacja nie ma tablic stron, więc przeniesienie kopiuje zawartość stron.
+    void* moved = mmap_locked(new_pages);
+    if (moved != (void*)-1) {
+        memmove(moved, addr, old_pages * PAGE_SIZE);
+        munmap_locked(start, old_pages);
+    }
+    pthread_mutex_unlock(&mm.lock);
+    return moved;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "allocomora.h"
+#include "custom_unistd.h"
+
+// Replays a trace written by heap_trace_start() in the order of its timestamps, on one thread.
+// Usage: replay <trace file> [glibc]
+// Results are printed as "benchmark,metric,value" lines, like the ones of the bench program.
+
+#define FRAGMENTATION_SAMPLES 20
+
+struct block_map_t {
+    uint64_t *ids; // 0 for an empty slot
+    void **blocks;
+    size_t capacity; // a power of 2
+    size_t count;
+};
+
+struct replay_stats_t {
+    uint64_t unmatched_frees; // ids the replay doesn't know, e.g. blocks allocated before the trace started
+    uint64_t reused_ids; // ids allocated again before their free, threads' records may interleave so
+    uint64_t failed_allocs;
+};
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+int record_compare(const void *a, const void *b) {
+    const struct trace_record_t *r1 = a, *r2 = b;
+    if(r1->time!=r2->time) return (r1->time>r2->time)-(r1->time<r2->time);
+    return (r1->thread>r2->thread)-(r1->thread<r2->thread);
+}
+
+size_t map_slot(struct block_map_t *map, uint64_t id) {
+    size_t slot=(id*0x9E3779B97F4A7C15ULL)>>20;
+    while(1) {
+        slot&=map->capacity-1;
+        if(map->ids[slot]==id || map->ids[slot]==0) return slot;
+        slot++;
+    }
+}
+
+void map_put(struct block_map_t *map, uint64_t id, void *block) {
+    size_t slot=map_slot(map,id);
+    if(map->ids[slot]==0) map->count++;
+    map->ids[slot]=id;
+    map->blocks[slot]=block;
+}
+
+void *map_take(struct block_map_t *map, uint64_t id) {
+    // Removes the id, moving back the entries after it which would be cut off from their slots.
+    size_t slot=map_slot(map,id);
+    if(map->ids[slot]==0) return NULL;
+    void *block = map->blocks[slot];
+    map->ids[slot]=0;
+    map->count--;
+    for(size_t next=(slot+1)&(map->capacity-1); map->ids[next]; next=(next+1)&(map->capacity-1)) {
+        uint64_t moved_id=map->ids[next];
+        void *moved = map->blocks[next];
+        map->ids[next]=0;
+        map->count--;
+        map_put(map,moved_id,moved);
+    }
+    return block;
+}
+
+void sample_heap(size_t *peak_pages, double *fragmentation) {
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    if((size_t)stats.pages>*peak_pages) *peak_pages=stats.pages;
+    if(fragmentation) *fragmentation=stats.free_space ? 1.0-(double)stats.largest_free_area/stats.free_space : 0;
+}
+
+int main(int argc, char **argv) {
+    if(argc<2) {
+        fprintf(stderr,"Usage: %s <trace file> [glibc]\n",argv[0]);
+        return 1;
+    }
+    int glibc = argc>2 && strcmp(argv[2],"glibc")==0;
+    FILE *file = fopen(argv[1],"rb");
+    struct trace_header_t header;
+    if(file==NULL || fread(&header,sizeof(header),1,file)!=1 || header.magic!=TRACE_MAGIC
+        || header.version!=TRACE_VERSION || header.record_size!=sizeof(struct trace_record_t)) {
+        fprintf(stderr,"%s isn't a trace file of this version.\n",argv[1]);
+        return 1;
+    }
+    size_t count=0, capacity=1024;
+    struct trace_record_t *records = malloc(capacity*sizeof(struct trace_record_t));
+    while(fread(&records[count],sizeof(struct trace_record_t),1,file)==1) {
+        if(++count==capacity) {
+            capacity*=2;
+            records=realloc(records,capacity*sizeof(struct trace_record_t));
+        }
+    }
+    fclose(file);
+    qsort(records,count,sizeof(struct trace_record_t),record_compare);
+
+    struct block_map_t map = {0};
+    map.capacity=1024;
+    while(map.capacity<2*count) map.capacity*=2; // never more than half full
+    map.ids=calloc(map.capacity,sizeof(uint64_t));
+    map.blocks=calloc(map.capacity,sizeof(void*));
+    if(!glibc && heap_setup()!=0) return 1;
+
+    struct replay_stats_t stats = {0};
+    size_t peak_pages=0, sample_every=count/FRAGMENTATION_SAMPLES ? count/FRAGMENTATION_SAMPLES : 1;
+    double fragmentation[FRAGMENTATION_SAMPLES+1];
+    int samples=0;
+    double elapsed=0, start=now_ns();
+    for(size_t i=0; i<count; i++) {
+        struct trace_record_t *r = &records[i];
+        void *p = NULL;
+        switch(r->op) {
+            case trace_malloc:
+                p = glibc ? malloc(r->size) : heap_malloc(r->size);
+                break;
+            case trace_calloc:
+                p = glibc ? calloc(1,r->size) : heap_calloc(1,r->size);
+                break;
+            case trace_realloc: {
+                void *old = r->old_id ? map_take(&map,r->old_id) : NULL;
+                if(r->old_id && old==NULL) stats.unmatched_frees++;
+                p = glibc ? realloc(old,r->size) : heap_realloc(old,r->size);
+                if(p==NULL && r->size && old) map_put(&map,r->old_id,old); // the old block stays
+                break;
+            }
+            case trace_free: {
+                void *old = map_take(&map,r->id);
+                if(old==NULL) stats.unmatched_frees++;
+                else if(glibc) free(old);
+                else heap_free(old);
+                break;
+            }
+        }
+        if(r->op!=trace_free && r->id) {
+            if(p==NULL) stats.failed_allocs++;
+            else {
+                if(map.ids[map_slot(&map,r->id)]) stats.reused_ids++;
+                map_put(&map,r->id,p);
+            }
+        }
+        if(!glibc && (i+1)%sample_every==0) {
+            // Heap statistics aren't part of the replayed workload.
+            elapsed+=now_ns()-start;
+            sample_heap(&peak_pages,samples<=FRAGMENTATION_SAMPLES ? &fragmentation[samples] : NULL);
+            samples++;
+            start=now_ns();
+        }
+    }
+    elapsed+=now_ns()-start;
+
+    const char *prefix = glibc ? "glibc_" : "";
+    printf("replay,%sops,%lu\n",prefix,count);
+    printf("replay,%sns_per_op,%.2f\n",prefix,count ? elapsed/count : 0);
+    printf("replay,%sunmatched_frees,%lu\n",prefix,stats.unmatched_frees);
+    printf("replay,%sreused_ids,%lu\n",prefix,stats.reused_ids);
+    printf("replay,%sfailed_allocs,%lu\n",prefix,stats.failed_allocs);
+    if(!glibc) {
+        sample_heap(&peak_pages,NULL);
+        printf("replay,peak_pages,%lu\n",peak_pages);
+        for(int s=0; s<samples && s<=FRAGMENTATION_SAMPLES; s++) {
+            printf("replay,fragmentation_at_%lu,%.4f\n",(s+1)*sample_every,fragmentation[s]);
+        }
+        heap_delete(1);
+    }
+    free(map.ids);
+    free(map.blocks);
+    free(records);
+    return 0;
+}
@@ -19,6 +19,17 @@ void extend_size() {
     }
 }
 
+void check_heap_data() {
+    struct chunk_t *c = get_heap()->head_chunk;
+    int chunks = 1;
+    while(c->next) {
+        c=c->next;
+        chunks++;
+    }
+    assert(get_heap()->tail_chunk==c);
+    assert(get_heap()->chunks==chunks);
+}
+
 void test1() {
     int status = heap_setup();
     assert(status==0);
@@ -71,6 +82,9 @@ void test5() {
     char *p1 = heap_malloc(100*MB);
     assert(p1==NULL);
     assert(heap_validate()==no_errors);
+    p1 = heap_malloc((size_t)1<<40); // beyond the last first-level bin of the free index
+    assert(p1==NULL);
+    assert(heap_validate()==no_errors);
     assert(heap_get_used_blocks_count()==0);
     assert(heap_get_free_gaps_count()==1);
     assert(heap_get_used_space()==init_used_bytes);
@@ -280,8 +294,13 @@ void test14() {
     assert(get_pointer_type(p1)==pointer_valid);
     assert(heap_validate()==no_errors);
     assert(heap_get_free_space()<PAGE_SIZE);
+    int pages = get_heap()->pages;
     char *p2 = heap_malloc_aligned(PAGE_SIZE);
-    assert(p2==NULL);
+    assert(p2!=NULL);
+    assert(((intptr_t)p2 & (intptr_t)(PAGE_SIZE-1))==0);
+    assert(get_heap()->pages>pages);
+    assert(heap_validate()==no_errors);
+    heap_free(p2);
     heap_free(p1);
     assert(heap_validate()==no_errors);
     assert(heap_get_used_blocks_count()==0);
@@ -366,7 +385,7 @@ void test17() {
     int checksum = chunk->checksum;
     memset(chunk,0,sizeof(struct chunk_t));
     update_chunk_checksum(chunk);
-    assert(chunk->checksum==1);
+    assert(chunk->checksum!=checksum);
     assert(verify_chunk_checksum(chunk)==0); // checksum is calculated correctly
     assert(heap_validate()!=no_errors);
     
@@ -374,29 +393,38 @@ void test17() {
     chunk->prev=NULL;
     chunk->size=size;
     chunk->next=NULL;
-    chunk->debug_line=0;
-    chunk->debug_file=NULL;
+    chunk->debug=0;
     chunk->alloc=0;
     chunk->second_fence=SECFENCE;
 
     update_chunk_checksum(chunk);
-    assert(chunk->checksum==checksum);
+#if INTEGRITY_CHECKSUMS
+    assert(chunk->checksum==checksum); // the heap keeps checksums up to date only in integrity profile 2
+#endif
     assert(verify_chunk_checksum(chunk)==0);
     assert(heap_validate()==no_errors);
 
+    checksum=chunk->checksum;
     chunk->first_fence=FIRFENCE+1;
     update_chunk_checksum(chunk);
     assert(chunk->checksum!=checksum);
     assert(verify_chunk_checksum(chunk)==0); // checksum is valid, it's the first fence that is invalid.
+#if INTEGRITY_FENCES
     assert(heap_validate()==err_chunk_fence1);
+#else
+    assert(heap_validate()==no_errors);
+#endif
 
     chunk->first_fence=FIRFENCE;
     update_chunk_checksum(chunk);
 
+    update_heap_checksum();
     checksum=get_heap()->checksum;
     get_heap()->checksum=checksum+5;
     assert(verify_heap_checksum()!=0);
+#if INTEGRITY_CHECKSUMS
     assert(heap_validate()==err_heap_checksum);
+#endif
     update_heap_checksum();
     assert(checksum==get_heap()->checksum);
     assert(verify_heap_checksum()==0);
@@ -405,10 +433,12 @@ void test17() {
 
 void test18() {
     assert(heap_validate()==no_errors);
+#if INTEGRITY_CHECKSUMS
     get_heap()->checksum=get_heap()->checksum+10;
     assert(heap_validate()==err_heap_checksum);
     get_heap()->checksum=get_heap()->checksum-10;
     assert(heap_validate()==no_errors);
+#endif
 
     struct chunk_t *c = get_heap()->head_chunk;
     get_heap()->head_chunk=NULL;
@@ -416,6 +446,10 @@ void test18() {
     assert(heap_validate()==err_head_is_null);
     get_heap()->head_chunk=c;
     get_heap()->tail_chunk=NULL;
+#if INTEGRITY_CHECKSUMS
+    assert(heap_validate()==err_heap_checksum); // fields swapping their values are noticed by the checksum
+#endif
+    update_heap_checksum();
     assert(heap_validate()==err_tail_is_null);
     update_heap_data();
     assert(heap_validate()==no_errors);
@@ -427,6 +461,7 @@ void test18() {
     update_heap_checksum();
     assert(heap_validate()==no_errors);
 
+#if INTEGRITY_FENCES
     *(get_heap()->end_fence_p)=1;
     assert(heap_validate()==err_end_fence);
     *(get_heap()->end_fence_p)=LASFENCE;
@@ -439,11 +474,14 @@ void test18() {
     assert(heap_validate()==err_chunk_fence2);
     c->second_fence=SECFENCE;
     assert(heap_validate()==no_errors);
+#endif
 
+#if INTEGRITY_CHECKSUMS
     c->checksum=c->checksum+10;
     assert(heap_validate()==err_chunk_checksum);
     c->checksum=c->checksum-10;
     assert(heap_validate()==no_errors);
+#endif
 
     c->next=c+1;
     update_chunk_checksum(c);
@@ -517,6 +555,1121 @@ void* test19b(void *pointer) {
     return NULL;
 }
 
+void test20() {
+    char *p1 = heap_malloc(100);
+    char *g1 = heap_malloc(300);
+    char *p2 = heap_malloc(100);
+    char *g2 = heap_malloc(200);
+    char *p3 = heap_malloc(100);
+    char *g3 = heap_malloc(500);
+    char *p4 = heap_malloc(100);
+    assert(p1!=NULL && g1!=NULL && p2!=NULL && g2!=NULL && p3!=NULL && g3!=NULL && p4!=NULL);
+    heap_free(g1);
+    heap_free(g2);
+    heap_free(g3);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_free_gaps_count()==4);
+
+    char *b1 = heap_malloc(200-sizeof(struct chunk_t)-16); // the best fit is the 200 B gap, 16 B are left after splitting
+    assert(b1==g2);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_control_block(b1)->next->size==16);
+    char *b2 = heap_malloc(300); // exact fit
+    assert(b2==g1);
+    char *b3 = heap_malloc(16); // exact fit, the cut from the first split
+    assert(b3==(char*)heap_get_control_block(b1)->next+sizeof(struct chunk_t));
+    assert(heap_validate()==no_errors);
+
+    struct chunk_t *gap = heap_get_control_block(p3)->next;
+    gap->alloc=1;
+    update_chunk_checksum(gap);
+    assert(heap_validate()==err_free_index);
+    gap->alloc=0;
+    update_chunk_checksum(gap);
+    assert(heap_validate()==no_errors);
+
+    heap_free(p1);
+    heap_free(p2);
+    heap_free(p3);
+    heap_free(p4);
+    heap_free(b1);
+    heap_free(b2);
+    heap_free(b3);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_get_free_gaps_count()==1);
+}
+
+void test21() {
+    char *small[40];
+    for(int i=0; i<40; i++) {
+        small[i] = heap_malloc(50);
+        assert(small[i]!=NULL);
+    }
+    char *big = heap_malloc(3*PAGE_SIZE);
+    assert(big!=NULL);
+    char *last = heap_malloc(10);
+    assert(last!=NULL);
+    assert(heap_validate()==no_errors);
+
+    // many control blocks in one page
+    for(int i=0; i<40; i++) {
+        assert(get_pointer_type(small[i])==pointer_valid);
+        assert(get_pointer_type(small[i]-1)==pointer_control_block);
+        assert(get_pointer_type(small[i]+49)==pointer_inside_data_block);
+        assert(heap_get_data_block_start(small[i]+25)==small[i]);
+    }
+    // pages without any control block
+    assert(get_pointer_type(big+PAGE_SIZE)==pointer_inside_data_block);
+    assert(get_pointer_type(big+3*PAGE_SIZE-1)==pointer_inside_data_block);
+    assert(heap_get_data_block_start(big+2*PAGE_SIZE+7)==big);
+    assert(get_pointer_type(last)==pointer_valid);
+
+    heap_free(big);
+    assert(get_pointer_type(big+PAGE_SIZE)==pointer_unallocated);
+    for(int i=0; i<40; i+=2) heap_free(small[i]);
+    assert(heap_validate()==no_errors);
+    for(int i=1; i<40; i+=2) {
+        assert(get_pointer_type(small[i])==pointer_valid);
+        assert(get_pointer_type(small[i-1])==pointer_unallocated);
+        heap_free(small[i]);
+    }
+    assert(get_pointer_type(small[20]+30)==pointer_unallocated);
+    heap_free(last);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_get_free_gaps_count()==1);
+}
+
+void test22() {
+    char *p1 = heap_malloc(200);
+    assert(p1!=NULL);
+    check_heap_data();
+    char *p2 = heap_malloc(heap_get_control_block(p1)->next->size); // takes the whole tail chunk
+    assert(p2!=NULL);
+    assert(get_heap()->tail_chunk==heap_get_control_block(p2));
+    check_heap_data();
+    char *p3 = heap_malloc(PAGE_SIZE); // grows the heap after an allocated tail chunk
+    assert(p3!=NULL);
+    assert(heap_validate()==no_errors);
+    check_heap_data();
+    char *p4 = heap_realloc(p3,100);
+    assert(p4==p3);
+    check_heap_data();
+    heap_free(p2);
+    check_heap_data();
+    heap_free(p4);
+    check_heap_data();
+    heap_free(p1);
+    check_heap_data();
+    assert(get_heap()->chunks==1);
+    assert(heap_validate()==no_errors);
+}
+
+volatile int test23_running;
+
+void* test23_monitor(void *arg) {
+    struct heap_stats_t stats;
+    while(test23_running) {
+        heap_get_stats(&stats);
+        assert(stats.used_space+stats.free_space==(size_t)stats.pages*PAGE_SIZE);
+        assert(stats.used_blocks_count<=(uint64_t)stats.chunks);
+        assert(stats.largest_free_area<=stats.free_space);
+    }
+    return NULL;
+}
+
+void* test23_worker(void *arg) {
+    char *p[50];
+    for(int round=0; round<20; round++) {
+        for(int i=0; i<50; i++) {
+            p[i] = heap_malloc(16+(i*37)%300);
+            assert(p[i]!=NULL);
+        }
+        for(int i=0; i<50; i++) heap_free(p[i]);
+    }
+    return NULL;
+}
+
+void test23() {
+    struct heap_stats_t stats;
+    char *p1 = heap_malloc(300);
+    char *p2 = heap_malloc(500);
+    assert(p1!=NULL && p2!=NULL);
+    heap_free(p1);
+    heap_get_stats(&stats);
+    assert(stats.used_space==heap_get_used_space());
+    assert(stats.free_space==heap_get_free_space());
+    assert(stats.largest_free_area==heap_get_largest_free_area());
+    assert(stats.used_blocks_count==1);
+    assert(stats.free_gaps_count==2);
+    assert(stats.used_space==3*sizeof(struct chunk_t)+500+sizeof(int));
+    assert(stats.pages==get_heap()->pages);
+    assert(stats.chunks==3);
+    char *p3 = heap_malloc(stats.largest_free_area); // takes the free tail, the largest free chunk is p1 again
+    assert(p3!=NULL);
+    assert(heap_get_largest_free_area()==300);
+    heap_free(p3);
+    heap_free(p2);
+
+    pthread_t monitor, workers[4];
+    test23_running=1;
+    pthread_create(&monitor,NULL,test23_monitor,NULL);
+    for(int i=0; i<4; i++) pthread_create(&workers[i],NULL,test23_worker,NULL);
+    for(int i=0; i<4; i++) pthread_join(workers[i],NULL);
+    test23_running=0;
+    pthread_join(monitor,NULL);
+
+    assert(heap_validate()==no_errors);
+    heap_get_stats(&stats);
+    assert(stats.used_blocks_count==0);
+    assert(stats.free_gaps_count==1);
+}
+
+void* test24_worker(void *arg) {
+    for(int round=0; round<100; round++) {
+        char *p1 = heap_malloc(40);
+        char *p2 = heap_malloc(200);
+        assert(p1!=NULL && p2!=NULL);
+        heap_free(p1);
+        heap_free(p2);
+    }
+    char *p3 = heap_malloc(200);
+    assert(p3!=NULL);
+    return p3; // freed by another thread, ends up in its cache
+}
+
+void* test24_free(void *pointer) {
+    heap_free(pointer);
+    return NULL; // the cache is drained when the thread exits
+}
+
+void test24() {
+    struct heap_config_t config = {.thread_cache_count=4};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+
+    char *p1 = heap_malloc(100);
+    assert(p1!=NULL);
+    heap_free(p1);
+    assert(heap_get_used_blocks_count()==1); // cached chunks stay allocated for the heap
+    assert(get_pointer_type(p1)==pointer_unallocated);
+    char *p2 = heap_malloc(100);
+    assert(p2==p1);
+    assert(get_pointer_type(p2)==pointer_valid);
+    heap_free(p2);
+    heap_free(p2); // a double free is noticed
+    pthread_t thread;
+    pthread_create(&thread,NULL,test24_free,p2); // also by another thread, the block isn't cached twice
+    pthread_join(thread,NULL);
+    assert(heap_validate()==no_errors);
+    p1 = heap_malloc(100);
+    p2 = heap_malloc(100);
+    assert(p1!=NULL && p2!=NULL && p1!=p2);
+    heap_free(p1);
+    heap_free(p2);
+    heap_thread_cache_flush();
+    assert(heap_get_used_blocks_count()==0);
+
+    char *p[10];
+    for(int i=0; i<10; i++) {
+        p[i] = heap_malloc(64);
+        assert(p[i]!=NULL);
+    }
+    for(int i=0; i<10; i++) heap_free(p[i]); // the bin overflows and is flushed in batches
+    assert(heap_get_used_blocks_count()<=(uint64_t)config.thread_cache_count);
+    assert(heap_validate()==no_errors);
+    heap_thread_cache_flush();
+    assert(heap_get_used_blocks_count()==0);
+
+    pthread_t threads[8];
+    void *results[8];
+    for(int i=0; i<8; i++) pthread_create(&threads[i],NULL,test24_worker,NULL);
+    for(int i=0; i<8; i++) pthread_join(threads[i],&results[i]);
+    assert(heap_get_used_blocks_count()==8);
+    for(int i=0; i<8; i++) pthread_create(&threads[i],NULL,test24_free,results[i]);
+    for(int i=0; i<8; i++) pthread_join(threads[i],NULL);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_get_free_gaps_count()==1);
+
+    assert(heap_reset(0)==0); // keeps the configuration
+    p1 = heap_malloc(100);
+    heap_free(p1);
+    assert(heap_get_used_blocks_count()==1);
+    heap_thread_cache_flush();
+
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+}
+
+void* test25_worker(void *arg) {
+    char **p = arg;
+    for(int i=0; i<50; i++) {
+        p[i] = heap_malloc(100+i);
+        assert(p[i]!=NULL);
+        memset(p[i],i,100+i);
+    }
+    return NULL;
+}
+
+void test25() {
+    struct heap_config_t config = {.arena_count=4, .arena_pages=64};
+    assert(heap_delete(0)==0);
+    config.arena_pages=10;
+    assert(heap_setup_config(&config)==-1); // arena regions have to be multiples of 64 pages
+    config.arena_pages=64;
+    assert(heap_setup_config(&config)==0);
+    assert(heap_validate()==no_errors);
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    assert(stats.pages==3*64+PAGES_BGN);
+    assert(stats.used_blocks_count==0);
+    assert(stats.free_gaps_count==4);
+
+    pthread_t threads[4];
+    char *p[4][50];
+    for(int i=0; i<4; i++) pthread_create(&threads[i],NULL,test25_worker,p[i]);
+    for(int i=0; i<4; i++) pthread_join(threads[i],NULL);
+    int used_arenas[4]={0};
+    for(int i=0; i<4; i++) {
+        for(int j=0; j<50; j++) {
+            int arena = heap_get_arena(p[i][j]);
+            assert(arena>=0 && arena<4);
+            used_arenas[arena]=1;
+            assert(get_pointer_type(p[i][j])==pointer_valid);
+            assert(get_pointer_type(p[i][j]+50)==pointer_inside_data_block);
+            assert(heap_get_block_size(p[i][j])==100+j);
+        }
+    }
+    assert(used_arenas[0]+used_arenas[1]+used_arenas[2]+used_arenas[3]>1); // threads are spread over arenas
+    assert(heap_get_used_blocks_count()==200);
+    assert(heap_validate()==no_errors);
+
+    char *big = heap_malloc(300*KB); // bigger than an arena, served by the main heap
+    assert(big!=NULL);
+    assert(heap_get_arena(big)==0);
+    heap_free(big);
+
+    for(int i=0; i<4; i++) {
+        for(int j=0; j<50; j++) {
+            for(int k=0; k<100+j; k++) assert(p[i][j][k]==(char)j);
+            heap_free(p[i][j]); // freed by another thread than the one which allocated it
+        }
+    }
+    assert(heap_validate()==no_errors);
+    heap_get_stats(&stats);
+    assert(stats.used_blocks_count==0);
+    assert(stats.free_gaps_count==4);
+    assert(stats.used_space+stats.free_space==(size_t)stats.pages*PAGE_SIZE);
+    assert(heap_get_arena(get_heap()->data)==0);
+    assert(heap_get_arena((char*)get_heap()->data-1)==3);
+    assert(heap_get_arena((char*)get_heap()->end_fence_p+sizeof(int))==-1);
+
+    assert(heap_reset(0)==0); // keeps the configuration
+    heap_get_stats(&stats);
+    assert(stats.free_gaps_count==4);
+
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+}
+
+void test26() {
+    struct heap_config_t config = {.slab_max_size=SLAB_MAX_SIZE};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+
+    char *p[300];
+    for(int i=0; i<300; i++) {
+        p[i] = heap_malloc(8+i%3*4); // all in the 16 B class
+        assert(p[i]!=NULL);
+        assert(((intptr_t)p[i]&(SLAB_CLASS_SIZE-1))==0);
+        memset(p[i],i,8);
+    }
+    assert(p[1]==p[0]+SLAB_CLASS_SIZE);
+    assert(heap_get_used_blocks_count()==300);
+    assert(get_heap()->chunks<=4); // two slabs and the rest of the heap
+    assert(get_pointer_type(p[5])==pointer_valid);
+    assert(get_pointer_type(p[5]+3)==pointer_inside_data_block);
+    assert(get_pointer_type(p[0]-1)==pointer_control_block);
+    assert(heap_get_data_block_start(p[5]+3)==p[5]);
+    assert(heap_get_block_size(p[5])==SLAB_CLASS_SIZE);
+    assert(heap_get_control_block(p[5])==NULL);
+    assert(heap_validate()==no_errors);
+
+    heap_free(p[5]);
+    assert(get_pointer_type(p[5])==pointer_unallocated);
+    heap_free(p[5]); // a double free is noticed
+    assert(heap_get_used_blocks_count()==299);
+    char *p1 = heap_malloc(16);
+    assert(p1==p[5]); // the first free object is reused
+    p[5]=p1;
+    memset(p1,5,8);
+
+    char *p2 = heap_malloc(100);
+    assert(p2!=NULL && heap_get_block_size(p2)==112);
+    char *p3 = heap_realloc(p2,110); // still fits in its object
+    assert(p3==p2);
+    assert(heap_realloc(p2+8,50)==NULL); // not the start of an object
+    p3 = heap_realloc(p2,1000);
+    assert(p3!=NULL && p3!=p2 && heap_get_block_size(p3)==1000);
+    heap_free(p3);
+    char *p4 = heap_malloc_debug(16,__LINE__,__FILE__); // debug info needs a control block
+    assert(heap_get_control_block(p4)!=NULL);
+    heap_free(p4);
+
+    size_t used_space=heap_get_used_space();
+    assert(heap_get_free_space()+used_space==get_heap()->pages*PAGE_SIZE);
+    for(int i=0; i<300; i++) {
+        for(int k=0; k<8; k++) assert(p[i][k]==(char)i);
+        heap_free(p[i]);
+    }
+    assert(heap_get_used_space()<used_space); // free objects count as free space
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_validate()==no_errors);
+    assert(heap_delete(0)==0); // one empty slab per class is kept, it doesn't count as a used block
+
+    assert(heap_setup()==0);
+}
+
+void test27() {
+    assert(sizeof(struct chunk_t)<=40);
+#if !INTEGRITY_FENCES
+    char *p = heap_malloc_debug(100,__LINE__,__FILE__); // integrity profile 0 records no sites
+    assert(p!=NULL && heap_get_debug_site(p,NULL,NULL)==0);
+    heap_free(p);
+    assert(heap_validate()==no_errors);
+    return;
+#endif
+    char *p1 = heap_malloc_debug(100,__LINE__,__FILE__);
+    char *p2 = heap_malloc(100);
+    char *p3 = heap_calloc_debug(10,10,1234,"file.c");
+    assert(p1!=NULL && p2!=NULL && p3!=NULL);
+    const char *filename = NULL;
+    int fileline = 0;
+    assert(heap_get_debug_site(p1,&filename,&fileline)==1);
+    assert(fileline==__LINE__-7 && strcmp(filename,__FILE__)==0);
+    assert(heap_get_debug_site(p2,&filename,&fileline)==0);
+    assert(heap_get_debug_site(p3,&filename,&fileline)==1);
+    assert(fileline==1234 && strcmp(filename,"file.c")==0);
+    assert(heap_validate()==no_errors);
+
+    char *p4 = heap_realloc_debug(p3,50,1,"other.c"); // shrunk in place, keeps its site
+    assert(p4==p3);
+    assert(heap_get_debug_site(p4,&filename,&fileline)==1 && fileline==1234);
+    heap_free(p1);
+    assert(heap_get_debug_site(p1,NULL,NULL)==0);
+    char *p5 = heap_malloc(100); // reuses p1's chunk, without a site
+    assert(p5==p1);
+    assert(heap_get_debug_site(p5,NULL,NULL)==0);
+    assert(heap_validate()==no_errors);
+
+    heap_get_control_block(p4)->debug=0; // the entry of p4 is left without its chunk
+    update_chunk_checksum(heap_get_control_block(p4));
+    assert(heap_validate()==no_errors);
+    heap_get_control_block(p2)->debug=1;
+    update_chunk_checksum(heap_get_control_block(p2));
+    assert(heap_validate()==err_debug_site);
+    heap_get_control_block(p2)->debug=0;
+    update_chunk_checksum(heap_get_control_block(p2));
+    heap_get_control_block(p4)->debug=1;
+    update_chunk_checksum(heap_get_control_block(p4));
+    assert(heap_validate()==no_errors);
+
+    heap_free(p2);
+    heap_free(p4);
+    heap_free(p5);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+
+    // The site table grows, sites are kept for any number of blocks.
+    static char *blocks[DEBUG_SITES_INITIAL];
+    for(int i=0; i<DEBUG_SITES_INITIAL; i++) {
+        blocks[i] = heap_malloc_debug(16,i+1,"many.c");
+        assert(blocks[i]!=NULL);
+    }
+    for(int i=0; i<DEBUG_SITES_INITIAL; i++) {
+        assert(heap_get_debug_site(blocks[i],&filename,&fileline)==1 && fileline==i+1);
+    }
+    assert(heap_validate()==no_errors);
+    for(int i=0; i<DEBUG_SITES_INITIAL; i++) heap_free(blocks[i]);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+}
+
+void test28() {
+    char *p1 = heap_malloc(MB);
+    assert(p1!=NULL);
+    int pages = get_heap()->pages;
+    heap_free(p1);
+    assert(get_heap()->pages<pages);
+    struct chunk_t *tail = get_heap()->tail_chunk;
+    assert(tail->alloc==0);
+    assert(tail->size>=TRIM_THRESHOLD_DEFAULT/2*PAGE_SIZE && tail->size<TRIM_THRESHOLD_DEFAULT*PAGE_SIZE);
+    assert(get_pointer_type(get_heap()->end_fence_p)==pointer_end_fence);
+    assert((char*)get_heap()->end_fence_p+sizeof(int)==(char*)get_heap()->data+get_heap()->pages*PAGE_SIZE);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_free_space()+heap_get_used_space()==get_heap()->pages*PAGE_SIZE);
+
+    pages = get_heap()->pages;
+    for(int i=0; i<10; i++) {
+        char *p2 = heap_malloc(8*PAGE_SIZE); // the pages kept after trimming avoid sbrk() ping-pong
+        assert(p2!=NULL);
+        heap_free(p2);
+        assert(get_heap()->pages==pages);
+    }
+
+    struct heap_config_t config = {.trim_threshold=TRIM_DISABLED};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+    p1 = heap_malloc(MB);
+    pages = get_heap()->pages;
+    heap_free(p1);
+    assert(get_heap()->pages==pages);
+    assert(heap_validate()==no_errors);
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+}
+
+void test29() {
+    struct heap_config_t config = {.large_threshold=64*KB};
+    assert(heap_delete(0)==0);
+    struct heap_config_t bad_config = {.large_threshold=100};
+    assert(heap_setup_config(&bad_config)==-1);
+    assert(heap_setup_config(&config)==0);
+    int pages = get_heap()->pages;
+    size_t empty_used = heap_get_used_space();
+    char *small = heap_malloc(1000);
+    assert(heap_get_arena(small)==0);
+
+    char *p1 = heap_malloc(MB);
+    assert(p1!=NULL);
+    assert(heap_get_arena(p1)==-1); // outside of the chunk list
+    assert(get_heap()->pages==pages);
+    assert(get_pointer_type(p1)==pointer_valid);
+    assert(get_pointer_type(p1+10)==pointer_inside_data_block);
+    assert(get_pointer_type(p1-1)==pointer_control_block);
+    assert(heap_get_data_block_start(p1+10)==p1);
+    assert(heap_get_block_size(p1)==MB);
+    assert(heap_get_control_block(p1)->alloc==CHUNK_LARGE);
+    assert(heap_get_largest_used_block_size()==MB);
+    assert(heap_get_used_blocks_count()==2);
+    assert(heap_validate()==no_errors);
+    struct heap_stats_t stats;
+    heap_get_stats(&stats);
+    assert(stats.free_space+stats.used_space==stats.pages*PAGE_SIZE);
+
+    // Growing into free pages right after the block keeps it in place.
+    char *p2 = heap_malloc(MB);
+    assert(p2!=NULL && p2<p1);
+    for(int i=0; i<MB; i++) p2[i]=i%251;
+    heap_free(p1);
+    assert(get_pointer_type(p1)==pointer_out_of_heap);
+    size_t used = heap_get_used_space();
+    p1 = heap_realloc(p2,2*MB);
+    assert(p1==p2);
+    assert(heap_get_block_size(p1)==2*MB);
+    assert(heap_get_used_space()==used+MB);
+    for(int i=0; i<MB; i++) assert(p1[i]==(char)(i%251));
+
+    // Shrinking gives the pages at the end back, growing beyond the free pages moves the block.
+    p1 = heap_realloc(p1,100*KB);
+    assert(p1==p2);
+    assert(heap_get_used_space()<used);
+    assert(get_pointer_type(p1+200*KB)==pointer_out_of_heap); // the page map forgets the pages given back
+    char *p3 = heap_malloc_debug(MB,__LINE__,__FILE__);
+    int line = __LINE__-1;
+    assert(p3!=NULL);
+    p1 = heap_realloc(p1,4*MB);
+    assert(p1!=NULL && p1!=p2);
+    for(int i=0; i<100*KB; i++) assert(p1[i]==(char)(i%251));
+    p3 = heap_realloc(p3,8*MB);
+    int site_line=line;
+    assert(heap_get_debug_site(p3,NULL,&site_line)==INTEGRITY_FENCES && site_line==line); // integrity profile 0 records no sites
+    assert(heap_validate()==no_errors);
+
+    heap_free(p1);
+    heap_free(p3);
+    heap_free(small);
+    assert(heap_get_used_space()==empty_used);
+    assert(heap_get_used_blocks_count()==0);
+    p1 = heap_calloc(2,MB);
+    assert(p1!=NULL && p1[2*MB-1]==0);
+    assert(heap_delete(0)==3);
+    assert(heap_delete(1)==0);
+    assert(heap_setup()==0);
+}
+
+void test30() {
+    assert(heap_malloc_aligned_ex(100,0)==NULL);
+    assert(heap_malloc_aligned_ex(100,48)==NULL);
+    assert(heap_malloc_aligned_ex(100,4*MB)==NULL);
+    uint64_t used_blocks = heap_get_used_blocks_count();
+
+    // The slack before an aligned block goes back to the free chunks.
+    char *p1 = heap_malloc_aligned_ex(1000,256);
+    assert(p1!=NULL);
+    assert(((intptr_t)p1 & 255)==0);
+    assert(heap_get_block_size(p1)==1000);
+    assert(heap_get_free_space()+heap_get_used_space()==get_heap()->pages*PAGE_SIZE);
+    assert(heap_get_used_blocks_count()==used_blocks+1);
+    heap_free(p1);
+
+    char *p[24];
+    for(int i=0; i<24; i++) {
+        size_t alignment = (size_t)1<<(4+i%18); // 16 B to 2 MB
+        p[i] = heap_malloc_aligned_ex(100+i*37,alignment);
+        assert(p[i]!=NULL);
+        assert(((intptr_t)p[i] & (intptr_t)(alignment-1))==0);
+        assert(get_pointer_type(p[i])==pointer_valid);
+        memset(p[i],i,100+i*37);
+    }
+    assert(heap_validate()==no_errors);
+    for(int i=0; i<24; i++) {
+        for(int j=0; j<100+i*37; j++) assert(p[i][j]==i);
+        heap_free(p[i]);
+    }
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==used_blocks);
+    assert(heap_get_free_space()+heap_get_used_space()==get_heap()->pages*PAGE_SIZE);
+}
+
+void test31() {
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+    struct heap_realloc_stats_t stats;
+
+    // The tail chunk grows with the heap.
+    char *p1 = heap_malloc(100);
+    char *p2 = heap_malloc(get_heap()->tail_chunk->size);
+    assert(p2!=NULL && get_heap()->tail_chunk==heap_get_control_block(p2));
+    memset(p2,7,heap_get_block_size(p2));
+    int pages = get_heap()->pages;
+    size_t size = heap_get_block_size(p2)+3*PAGE_SIZE;
+    char *p3 = heap_realloc(p2,size);
+    assert(p3==p2);
+    assert(heap_get_block_size(p3)==size);
+    assert(get_heap()->pages>pages);
+    for(size_t i=0; i<size-3*PAGE_SIZE; i++) assert(p3[i]==7);
+    heap_get_realloc_stats(&stats);
+    assert(stats.in_place_tail==1 && stats.copied==0);
+    assert(heap_validate()==no_errors);
+    check_heap_data();
+
+    // A free chunk before the block takes it, the data moves back.
+    p2 = heap_realloc(p3,200);
+    assert(p2==p3);
+    char *p4 = heap_malloc(200);
+    p3 = heap_malloc(200); // keeps p4 from growing forwards
+    assert(heap_get_control_block(p3)->prev==heap_get_control_block(p4));
+    heap_free(p2);
+    for(int i=0; i<200; i++) p4[i]=i;
+    p2 = heap_realloc(p4,350);
+    assert(p2<p4);
+    assert(heap_get_block_size(p2)==350);
+    for(int i=0; i<200; i++) assert(p2[i]==(char)i);
+    heap_get_realloc_stats(&stats);
+    assert(stats.moved_prev==1 && stats.in_place_shrink==1);
+    assert(heap_validate()==no_errors);
+    check_heap_data();
+
+    // With no free neighbours the block is copied.
+    p4 = heap_realloc(p2,PAGE_SIZE);
+    assert(p4!=p2);
+    for(int i=0; i<200; i++) assert(p4[i]==(char)i);
+    heap_get_realloc_stats(&stats);
+    assert(stats.copied==1 && stats.in_place_next==0);
+    heap_free(p1);
+    heap_free(p3);
+    heap_free(p4);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+}
+
+void test32() {
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+    int chunks = get_heap()->chunks;
+    void *p[100];
+    assert(heap_malloc_batch(50,40,p)==50);
+    for(int i=0; i<50; i++) {
+        assert(get_pointer_type(p[i])==pointer_valid);
+        assert(heap_get_block_size(p[i])==40);
+        if(i>0) assert((char*)p[i]==(char*)p[i-1]+40+sizeof(struct chunk_t)); // carved one after another
+        memset(p[i],i,40);
+    }
+    assert(heap_get_used_blocks_count()==50);
+    assert(heap_validate()==no_errors);
+    check_heap_data();
+
+    // Blocks which don't fit in the free chunks come from a grown heap.
+    int pages = get_heap()->pages;
+    assert(heap_malloc_batch(50,1000,p+50)==50);
+    assert(get_heap()->pages>pages);
+    assert(heap_validate()==no_errors);
+    for(int i=50; i<100; i++) memset(p[i],i,1000);
+    for(int i=0; i<50; i++) for(int j=0; j<40; j++) assert(((char*)p[i])[j]==i);
+
+    // Freed in a shuffled order, the neighbours still end up in one free chunk.
+    for(int i=0; i<100; i++) {
+        int j = (i*37)%100;
+        void *tmp = p[i];
+        p[i] = p[j];
+        p[j] = tmp;
+    }
+    void *extra[3] = {NULL, p[0], (char*)p[1]+1}; // NULL, a duplicate and an invalid pointer are skipped
+    heap_free_batch(p,100);
+    heap_free_batch(extra,3);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(get_heap()->chunks==chunks);
+    assert(heap_get_free_gaps_count()==1);
+    check_heap_data();
+
+    assert(heap_malloc_batch(0,40,p)==0);
+    assert(heap_malloc_batch(2,SIZE_MAX/2,p)==0);
+    assert(heap_get_used_blocks_count()==0);
+
+    struct heap_config_t config = {.slab_max_size=64};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+    assert(heap_malloc_batch(100,24,p)==100);
+    for(int i=0; i<100; i++) {
+        assert(get_pointer_type(p[i])==pointer_valid);
+        assert(heap_get_control_block(p[i])==NULL); // slab objects
+    }
+    heap_free_batch(p,100);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_validate()==no_errors);
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+}
+
+void test33() {
+    struct heap_config_t config = {.slab_max_size=64, .large_threshold=64*KB, .thread_cache_count=4};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+    char *p1 = heap_malloc(300);
+    char *p2 = heap_malloc(40); // slab object
+    char *p3 = heap_malloc(MB); // large block
+    assert(p1!=NULL && p2!=NULL && p3!=NULL);
+    uint64_t used_blocks = heap_get_used_blocks_count();
+
+    // Wrong sizes are caught, the blocks stay allocated.
+    heap_free_sized(p1,200);
+    heap_free_sized(p1,400);
+    heap_free_sized(p2,100);
+    heap_free_sized(p2,10);
+    heap_free_sized(p3,MB+1);
+    heap_free_sized(p1+16,300-16);
+    char *p4 = heap_malloc(40); // the next slab object, its "control block" is made of p2's data
+    assert(p4!=NULL);
+    struct chunk_t *fake = (struct chunk_t *)(p4-sizeof(struct chunk_t));
+    if(p4>p2 && (char*)fake>=p2) {
+        memset(fake,0,sizeof(struct chunk_t));
+        FENCES_SET(fake);
+        fake->alloc=1;
+        fake->size=100;
+        heap_free_sized(p4,100); // not taken by the thread cache either
+        assert(get_pointer_type(p4)==pointer_valid);
+        memset(fake,0,sizeof(struct chunk_t));
+    }
+    heap_free(p4);
+    assert(heap_get_used_blocks_count()==used_blocks);
+    assert(get_pointer_type(p1)==pointer_valid && get_pointer_type(p2)==pointer_valid && get_pointer_type(p3)==pointer_valid);
+    assert(heap_validate()==no_errors);
+
+    heap_free_sized(p1,300);
+    heap_free_sized(p2,40);
+    heap_free_sized(p3,MB);
+    assert(heap_get_used_blocks_count()==used_blocks-3);
+    heap_free_sized(p1,300); // already free
+    assert(heap_validate()==no_errors);
+
+    // A block shrunk in place keeps the bytes that were too few to split off.
+    p1 = heap_malloc(300);
+    p2 = heap_malloc(100);
+    p1 = heap_realloc(p1,290);
+    assert(heap_get_block_size(p1)==300);
+    heap_free_sized(p1,290);
+    heap_free_sized(p2,100);
+    assert(heap_get_used_blocks_count()==used_blocks-3);
+    assert(heap_validate()==no_errors);
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+}
+
+#define TEST34_BLOCKS 4000
+
+char *test34_blocks[TEST34_BLOCKS];
+volatile int test34_produced;
+
+void* test34_producer(void *arg) {
+    for(int i=0; i<TEST34_BLOCKS; i++) {
+        test34_blocks[i] = heap_malloc(16+(i*53)%500);
+        assert(test34_blocks[i]!=NULL);
+        memset(test34_blocks[i],i,16);
+        __atomic_store_n(&test34_produced,i+1,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void* test34_consumer(void *arg) {
+    // Consumers take every other block, so they free while the producer allocates.
+    for(int i=*(int*)arg; i<TEST34_BLOCKS; i+=2) {
+        while(__atomic_load_n(&test34_produced,__ATOMIC_ACQUIRE)<=i);
+        assert(test34_blocks[i][15]==(char)i);
+        heap_free(test34_blocks[i]);
+    }
+    return NULL;
+}
+
+void* test34_double_free(void *arg) {
+    for(int i=0; i<TEST34_BLOCKS; i++) heap_free(test34_blocks[i]);
+    return NULL;
+}
+
+void test34() {
+    pthread_t producer, consumers[2];
+    int first[2] = {0,1};
+    test34_produced=0;
+    pthread_create(&producer,NULL,test34_producer,NULL);
+    for(int i=0; i<2; i++) pthread_create(&consumers[i],NULL,test34_consumer,&first[i]);
+    pthread_join(producer,NULL);
+    for(int i=0; i<2; i++) pthread_join(consumers[i],NULL);
+
+    // Blocks queued by the consumers were freed by the last lock holder.
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_get_free_gaps_count()==1);
+
+    // Both consumers free every block, the second free of each one is rejected wherever the first went.
+    test34_producer(NULL);
+    for(int i=0; i<2; i++) pthread_create(&consumers[i],NULL,test34_double_free,NULL);
+    for(int i=0; i<2; i++) pthread_join(consumers[i],NULL);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_get_free_gaps_count()==1);
+}
+
+void test35() {
+    const char *path = "allocomora_test35.trace";
+    char *p1 = heap_malloc(100);
+    assert(heap_trace_start(path)==0);
+    assert(heap_trace_start(path)==1);
+    char *p2 = heap_calloc(4,50);
+    char *p3 = heap_malloc(300);
+    p2 = heap_realloc(p2,500);
+    heap_free(p1); // allocated before the trace started
+    heap_free(p2);
+    heap_free_sized(p3,300);
+    assert(heap_trace_stop()==0);
+    assert(heap_trace_stop()==1);
+    heap_free(heap_malloc(10)); // not recorded anymore
+
+    FILE *file = fopen(path,"rb");
+    assert(file!=NULL);
+    struct trace_header_t header;
+    struct trace_record_t records[8];
+    assert(fread(&header,sizeof(header),1,file)==1);
+    assert(header.magic==TRACE_MAGIC && header.version==TRACE_VERSION && header.record_size==sizeof(struct trace_record_t));
+    assert(fread(records,sizeof(struct trace_record_t),8,file)==6);
+    fclose(file);
+    remove(path);
+
+    uint8_t ops[6] = {trace_calloc,trace_malloc,trace_realloc,trace_free,trace_free,trace_free};
+    for(int i=0; i<6; i++) {
+        assert(records[i].op==ops[i]);
+        assert(records[i].thread==0);
+        assert(i==0 || records[i].time>=records[i-1].time);
+    }
+    assert(records[0].size==200 && records[1].size==300 && records[2].size==500);
+    assert(records[1].id==(uintptr_t)p3 && records[2].id==(uintptr_t)p2);
+    assert(records[2].old_id==records[0].id);
+    assert(records[3].id==(uintptr_t)p1 && records[4].id==(uintptr_t)p2 && records[5].id==(uintptr_t)p3);
+    assert(heap_validate()==no_errors);
+}
+
+void test36() {
+    struct heap_config_t config = {.slab_max_size=64, .large_threshold=64*KB};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+    struct heap_fragmentation_report_t report;
+    heap_get_fragmentation_report(&report);
+    assert(report.used_blocks[0]==0 && report.wasted_tails==0);
+    assert(report.free_blocks[63-__builtin_clzll(heap_get_free_space())]==1);
+
+    char *p1 = heap_malloc(100);
+    char *p2 = heap_malloc(40); // slab object of 48 bytes
+    char *p3 = heap_malloc(3000);
+    char *p4 = heap_malloc(MB); // large block
+    char *p5 = heap_malloc(200);
+    assert(p1!=NULL && p2!=NULL && p3!=NULL && p4!=NULL && p5!=NULL);
+    heap_free(p3);
+    heap_get_fragmentation_report(&report);
+    assert(report.used_blocks[6]==1 && report.used_blocks[5]==1 && report.used_blocks[20]==1 && report.used_blocks[7]==1);
+    assert(report.free_blocks[11]==1); // the freed 3000 bytes
+    uint64_t used=0;
+    for(int i=0; i<SIZE_BUCKETS; i++) used+=report.used_blocks[i];
+    assert(used==heap_get_used_blocks_count());
+    assert(report.external_fragmentation>0 && report.external_fragmentation<1);
+    assert(report.header_overhead==(size_t)(get_heap()->chunks+1)*sizeof(struct chunk_t)+sizeof(struct slab_t));
+
+    // Shrinking by less than a control block leaves a tail.
+    p1 = heap_realloc(p1,90);
+    heap_get_fragmentation_report(&report);
+    assert(report.wasted_tails==1 && report.wasted_tail_bytes==10);
+    assert(report.used_blocks[6]==1);
+
+    heap_free(p1);
+    heap_free(p2);
+    heap_free(p4);
+    heap_free(p5);
+    heap_get_fragmentation_report(&report);
+    used=0;
+    for(int i=0; i<SIZE_BUCKETS; i++) used+=report.used_blocks[i];
+    assert(used==0);
+    assert(heap_validate()==no_errors);
+    assert(heap_delete(0)==0);
+
+    // A thread cache hands out chunks a little bigger than asked for too.
+    config.slab_max_size=0; // integrity profile 0 caches blocks only without slabs
+    config.thread_cache_count=4;
+    assert(heap_setup_config(&config)==0);
+    p1 = heap_malloc(100);
+    heap_free(p1);
+    p2 = heap_malloc(97); // same size class
+    assert(p2==p1);
+    heap_get_fragmentation_report(&report);
+    assert(report.wasted_tails==1 && report.wasted_tail_bytes==3);
+    heap_free(p2);
+    heap_thread_cache_flush();
+    assert(heap_delete(0)==0);
+    assert(heap_setup()==0);
+}
+
+void* test37_worker(void *arg) {
+    for(int i=0; i<100; i++) heap_free(heap_malloc(100+i));
+    return NULL;
+}
+
+void test37() {
+    struct heap_instrument_t instrument;
+    heap_reset_instrument();
+    char *p1 = heap_malloc(100);
+    char *p2 = heap_malloc_aligned_ex(200,64);
+    char *p3 = heap_calloc(10,30);
+    p1 = heap_realloc(p1,50);
+    heap_free(p1);
+    heap_free(p2);
+    heap_free_sized(p3,300);
+    pthread_t worker;
+    pthread_create(&worker,NULL,test37_worker,NULL);
+    pthread_join(worker,NULL);
+    heap_get_instrument(&instrument);
+#if ALLOCOMORA_INSTRUMENT
+    // Counts of the exited worker are kept.
+    assert(instrument.calls[timed_malloc]==102 && instrument.calls[timed_free]==103);
+    assert(instrument.calls[timed_realloc]==1 && instrument.calls[timed_malloc_aligned]==1);
+    assert(instrument.calls[timed_split]>0 && instrument.calls[timed_merge]>0);
+    uint64_t calls=0;
+    for(int i=0; i<LATENCY_BUCKETS; i++) calls+=instrument.latency[timed_malloc][i];
+    assert(calls==102);
+    assert(instrument.find_free_calls>=101 && instrument.find_free_inspected>=instrument.find_free_calls);
+    assert(instrument.checksum_updates>0 || !INTEGRITY_CHECKSUMS);
+#else
+    assert(instrument.calls[timed_malloc]==0 && instrument.checksum_updates==0);
+#endif
+    heap_reset_instrument();
+    heap_get_instrument(&instrument);
+    assert(instrument.calls[timed_malloc]==0 && instrument.find_free_calls==0);
+    assert(heap_validate()==no_errors);
+}
+
+void test38() {
+    uint64_t used_blocks = heap_get_used_blocks_count();
+    size_t used_space = heap_get_used_space();
+    struct heap_region_t *region = heap_region_create(KB);
+    assert(region!=NULL && region->block_count==1);
+    assert(heap_region_alloc(region,0)==NULL);
+    assert(heap_get_used_blocks_count()==used_blocks+1); // the region is a single block for the heap
+
+    // Allocations are aligned and packed one after another, the region grows by chaining blocks.
+    char *objects[200];
+    for(int i=0; i<200; i++) {
+        objects[i] = heap_region_alloc(region,24+i%8);
+        assert(objects[i]!=NULL && ((uintptr_t)objects[i]&(REGION_ALIGNMENT-1))==0);
+        memset(objects[i],i,24+i%8);
+        if(i>0 && region->block_count==1) assert(objects[i]==objects[i-1]+32);
+    }
+    size_t sizes=0;
+    for(int i=0; i<200; i++) {
+        assert(objects[i][23]==(char)i);
+        sizes+=24+i%8;
+    }
+    assert(region->block_count==3 && region->blocks->size==4*KB); // blocks double in size
+    assert(region->allocated>=sizes && region->allocated<sizes+200*REGION_ALIGNMENT);
+    assert(heap_get_used_blocks_count()==used_blocks+region->block_count);
+    assert(heap_validate()==no_errors);
+
+    // A big allocation gets a block of its own size.
+    char *big = heap_region_alloc(region,2*MB);
+    assert(big!=NULL && region->blocks->size>=2*MB && region->end-big>=2*MB);
+    memset(big,1,2*MB);
+    assert(heap_validate()==no_errors);
+
+    struct heap_region_t *other = heap_region_create(0);
+    assert(other!=NULL && other->blocks->size==REGION_SIZE_DEFAULT);
+    assert(heap_region_alloc(other,100)!=NULL);
+    assert(heap_validate()==no_errors);
+
+    char *top = region->top;
+    region->top=region->end+1;
+    assert(heap_validate()==err_region);
+    region->top=top;
+#if INTEGRITY_FENCES
+    region->blocks->fence=0;
+    assert(heap_validate()==err_region);
+    region->blocks->fence=REGIONFENCE;
+#endif
+    assert(heap_validate()==no_errors);
+
+    heap_region_destroy(region);
+    assert(heap_validate()==no_errors);
+    heap_region_destroy(other);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==used_blocks);
+    assert(heap_get_used_space()==used_space);
+}
+
+void test39() {
+    uint64_t used_blocks = heap_get_used_blocks_count();
+    assert(heap_pool_create(0,10)==NULL);
+    struct heap_pool_t *pool = heap_pool_create(20,50); // objects of 24 bytes
+    assert(pool!=NULL && pool->object_size==24 && pool->block_count==0);
+    struct heap_pool_stats_t stats;
+    heap_get_pool_stats(pool,&stats);
+    assert(stats.pools==1 && stats.blocks==0 && stats.objects_used==0 && stats.objects_free==0);
+
+    // Objects of a block are carved one after another, freed ones are reused first.
+    char *objects[120];
+    for(int i=0; i<120; i++) {
+        objects[i] = heap_pool_alloc(pool);
+        assert(objects[i]!=NULL && ((uintptr_t)objects[i]&(sizeof(void*)-1))==0);
+        memset(objects[i],i,20);
+        if(i%50) assert(objects[i]==objects[i-1]+24);
+    }
+    assert(pool->block_count==3);
+    assert(heap_get_used_blocks_count()==used_blocks+4); // three blocks and the pool itself
+    heap_pool_free(pool,objects[10]);
+    heap_pool_free(pool,objects[70]);
+    heap_get_pool_stats(pool,&stats);
+    assert(stats.blocks==3 && stats.objects_used==118 && stats.objects_free==32 && stats.used_space==118*24);
+    assert(stats.block_space==3*(sizeof(struct pool_block_t)+50*24));
+    assert(heap_validate()==no_errors);
+    assert(heap_pool_alloc(pool)==objects[70]);
+    assert(heap_pool_alloc(pool)==objects[10]);
+    for(int i=0; i<120; i++) assert(i==10 || i==70 || objects[i][19]==(char)i);
+
+    struct heap_pool_t *other = heap_pool_create(100,0);
+    assert(other!=NULL && other->objects_per_block==POOL_OBJECTS_DEFAULT);
+    void *object = heap_pool_alloc(other);
+    assert(object!=NULL);
+    heap_get_pool_stats(NULL,&stats);
+    assert(stats.pools==2 && stats.blocks==4 && stats.objects_used==121);
+    assert(heap_validate()==no_errors);
+
+    // Free lists pointing outside the blocks or between objects are found.
+    heap_pool_free(other,object);
+    *(void**)object=objects[0]+8;
+    assert(heap_validate()==err_pool);
+    *(void**)object=objects[5];
+    assert(heap_validate()==err_pool);
+    *(void**)object=NULL;
+    assert(heap_validate()==no_errors);
+    pool->objects_used++;
+    assert(heap_validate()==err_pool);
+    pool->objects_used--;
+#if INTEGRITY_FENCES
+    pool->blocks->fence=0;
+    assert(heap_validate()==err_pool);
+    pool->blocks->fence=POOLFENCE;
+#endif
+    assert(heap_validate()==no_errors);
+
+    heap_pool_destroy(pool);
+    heap_pool_destroy(other);
+    heap_get_pool_stats(NULL,&stats);
+    assert(stats.pools==0 && stats.blocks==0);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==used_blocks);
+}
+
+void test40() {
+    struct heap_config_t config = {.quick_list_count=4};
+    assert(heap_delete(0)==0);
+    assert(heap_setup_config(&config)==0);
+    char *p[8];
+    for(int i=0; i<8; i++) {
+        p[i] = heap_malloc(100);
+        assert(p[i]!=NULL);
+    }
+    uint64_t gaps = heap_get_free_gaps_count();
+    size_t free_space = heap_get_free_space();
+
+    // Freed chunks are parked without merging and reused by the next request of their size class.
+    heap_free(p[2]);
+    heap_free(p[3]);
+    assert(heap_get_free_gaps_count()==gaps);
+    assert(heap_get_free_space()==free_space+200);
+    assert(heap_get_used_blocks_count()==6);
+    assert(get_pointer_type(p[3])==pointer_unallocated);
+    heap_free(p[3]); // freed twice, ignored
+    assert(heap_validate()==no_errors);
+    struct heap_fragmentation_report_t report;
+    heap_get_fragmentation_report(&report);
+    uint64_t wasted_tails = report.wasted_tails;
+    size_t wasted_tail_bytes = report.wasted_tail_bytes;
+    assert(heap_malloc(97)==p[3]); // 3 bytes more than asked for
+    heap_get_fragmentation_report(&report);
+    assert(report.wasted_tails==wasted_tails+1 && report.wasted_tail_bytes==wasted_tail_bytes+3);
+    assert(heap_malloc(100)==p[2]);
+    assert(heap_get_free_space()==free_space && heap_get_used_blocks_count()==8);
+
+    // A full quick list is merged before another chunk is parked.
+    for(int i=0; i<5; i++) heap_free(p[i]);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_free_gaps_count()==gaps+1); // the first four merged into one free chunk
+    assert(heap_get_free_space()==free_space+4*100+3*sizeof(struct chunk_t)+100);
+
+    // Parked chunks are merged when nothing else fits, before the heap grows.
+    heap_free(p[6]);
+    char *rest = heap_malloc(heap_get_largest_free_area()); // the free tail of the heap
+    assert(rest!=NULL);
+    int pages=get_heap()->pages;
+    char *q = heap_malloc(600); // fits once p[4] is merged with the chunk before it
+    assert(q==p[0] && get_heap()->pages==pages);
+    assert(get_pointer_type(p[6])==pointer_unallocated);
+    assert(heap_validate()==no_errors);
+
+    heap_free(p[5]);
+    struct chunk_t *parked = (struct chunk_t *)(p[5]-sizeof(struct chunk_t));
+    parked->alloc=1;
+    update_chunk_checksum(parked);
+    assert(heap_validate()==err_quick_list);
+    parked->alloc=CHUNK_QUICK;
+    update_chunk_checksum(parked);
+    assert(heap_validate()==no_errors);
+
+    heap_free(q);
+    heap_free(p[7]);
+    heap_free(rest);
+    assert(heap_validate()==no_errors);
+    assert(heap_get_used_blocks_count()==0);
+    assert(heap_delete(0)==0); // parked chunks don't count as allocated
+    assert(heap_setup()==0);
+}
+
 int main() {    
     printf("* Test 1: initialization of the heap :: ");
     if(LOG || TESTING) printf("\n");
@@ -599,7 +1752,7 @@ int main() {
     if(LOG || TESTING) printf("* Test 13 :: ");
     printf("SUCCESS!\n");
 
-    printf("* Test 14: malloc_aligned (there's no space and I'm sad) :: ");
+    printf("* Test 14: malloc_aligned (there's no space, the heap grows) :: ");
     if(LOG || TESTING) printf("\n");
     test14();
     if(LOG || TESTING) printf("* Test 14 :: ");
@@ -643,6 +1796,131 @@ int main() {
     if(LOG || TESTING) printf("* Test 19 :: ");
     printf("SUCCESS!\n");
 
+    printf("* Test 20: free chunk index (best fit, exact fit, validation) :: ");
+    if(LOG || TESTING) printf("\n");
+    test20();
+    if(LOG || TESTING) printf("* Test 20 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 21: page map (pointer types across pages) :: ");
+    if(LOG || TESTING) printf("\n");
+    test21();
+    if(LOG || TESTING) printf("* Test 21 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 22: heap data kept up to date by split, merge and growth :: ");
+    if(LOG || TESTING) printf("\n");
+    test22();
+    if(LOG || TESTING) printf("* Test 22 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 23: statistics snapshot while other threads allocate :: ");
+    if(LOG || TESTING) printf("\n");
+    test23();
+    if(LOG || TESTING) printf("* Test 23 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 24: thread caches :: ");
+    if(LOG || TESTING) printf("\n");
+    test24();
+    if(LOG || TESTING) printf("* Test 24 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 25: arenas :: ");
+    if(LOG || TESTING) printf("\n");
+    test25();
+    if(LOG || TESTING) printf("* Test 25 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 26: slabs for small objects :: ");
+    if(LOG || TESTING) printf("\n");
+    test26();
+    if(LOG || TESTING) printf("* Test 26 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 27: compact control blocks and the debug site table :: ");
+    if(LOG || TESTING) printf("\n");
+    test27();
+    if(LOG || TESTING) printf("* Test 27 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 28: trimming free pages at the end of the heap :: ");
+    if(LOG || TESTING) printf("\n");
+    test28();
+    if(LOG || TESTING) printf("* Test 28 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 29: large blocks in the mmap region :: ");
+    if(LOG || TESTING) printf("\n");
+    test29();
+    if(LOG || TESTING) printf("* Test 29 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 30: malloc_aligned_ex with alignments from 16 B to 2 MB :: ");
+    if(LOG || TESTING) printf("\n");
+    test30();
+    if(LOG || TESTING) printf("* Test 30 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 31: realloc growing in place at the tail and into a free predecessor :: ");
+    if(LOG || TESTING) printf("\n");
+    test31();
+    if(LOG || TESTING) printf("* Test 31 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 32: batch malloc and free :: ");
+    if(LOG || TESTING) printf("\n");
+    test32();
+    if(LOG || TESTING) printf("* Test 32 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 33: sized free :: ");
+    if(LOG || TESTING) printf("\n");
+    test33();
+    if(LOG || TESTING) printf("* Test 33 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 34: cross-thread frees :: ");
+    if(LOG || TESTING) printf("\n");
+    test34();
+    if(LOG || TESTING) printf("* Test 34 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 35: allocation trace :: ");
+    if(LOG || TESTING) printf("\n");
+    test35();
+    if(LOG || TESTING) printf("* Test 35 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 36: fragmentation report :: ");
+    if(LOG || TESTING) printf("\n");
+    test36();
+    if(LOG || TESTING) printf("* Test 36 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 37: instrumentation :: ");
+    if(LOG || TESTING) printf("\n");
+    test37();
+    if(LOG || TESTING) printf("* Test 37 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 38: regions :: ");
+    if(LOG || TESTING) printf("\n");
+    test38();
+    if(LOG || TESTING) printf("* Test 38 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 39: pools :: ");
+    if(LOG || TESTING) printf("\n");
+    test39();
+    if(LOG || TESTING) printf("* Test 39 :: ");
+    printf("SUCCESS!\n");
+
+    printf("* Test 40: quick lists :: ");
+    if(LOG || TESTING) printf("\n");
+    test40();
+    if(LOG || TESTING) printf("* Test 40 :: ");
+    printf("SUCCESS!\n");
 
     heap_dump_debug_information();
     assert(heap_validate()==no_errors);